@@ -0,0 +1,746 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <ftw.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <linux/perf_event.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "chunked.h"
+#include "inflate.h"
+#include "truncate.h"
+#include "untar.h"
+#include "poddos.h"
+
+// Size of the reads done by the consumer at the end of every pipeline
+#define BENCH_BUFSIZE 65536
+
+// Fixed seed, such that every run sees exactly the same inputs
+#define BENCH_SEED 0x9E3779B97F4A7C15ULL
+
+/**
+ * A growable in-memory buffer; all synthetic inputs are generated in memory
+ * such that the benchmark only measures the stream helpers and the file
+ * system, never the network.
+ */
+struct mem {
+    char *buf;
+    size_t n;
+    size_t cap;
+};
+
+static unsigned long long rnd = BENCH_SEED;
+
+static unsigned long long xorshift()
+{
+    rnd ^= rnd << 13;
+    rnd ^= rnd >> 7;
+    rnd ^= rnd << 17;
+    return rnd;
+}
+
+static void memput(struct mem *m, const void *buf, size_t n)
+{
+    if (m->n + n > m->cap) {
+        while (m->n + n > m->cap)
+            m->cap = m->cap ? 2 * m->cap : 65536;
+        m->buf = realloc(m->buf, m->cap);
+        if (!m->buf)
+            die("realloc");
+    }
+    memcpy(m->buf + m->n, buf, n);
+    m->n += n;
+}
+
+static void memfree(struct mem *m)
+{
+    free(m->buf);
+    memset(m, 0, sizeof(struct mem));
+}
+
+// Fill buf with data that compresses roughly like binaries and text do
+static void fill(char *buf, size_t n)
+{
+    static const char words[][8] = { "lib", "usr", "share", "python", "node", "\0\0\0\0", "ELF", "main" };
+    size_t i = 0;
+    while (i < n) {
+        unsigned long long r = xorshift();
+        if (r & 1) {
+            const char *w = words[(r >> 1) % 8];
+            for (int j = 0; j < 8 && i < n; j++)
+                buf[i++] = w[j];
+        } else {
+            for (int j = 0; j < 8 && i < n; j++)
+                buf[i++] = (char) (r >> (8 * j));
+        }
+    }
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *stage, double t, size_t bytes, size_t entries)
+{
+    if (entries)
+        printf("%-36s %10.1f MB/s %12.0f entries/s\n", stage, bytes / t / 1e6, entries / t);
+    else
+        printf("%-36s %10.1f MB/s\n", stage, bytes / t / 1e6);
+}
+
+// Value of "<key>: <value>" in a file in /proc/self, or -1 if it is not there
+static long procstat(const char *file, const char *key)
+{
+    char path[64], line[256];
+    snprintf(path, 64, "/proc/self/%s", file);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    long ret = -1;
+    size_t n = strlen(key);
+    while (fgets(line, 256, f)) {
+        if (!strncmp(line, key, n) && line[n] == ':') {
+            ret = strtol(line + n + 1, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return ret;
+}
+
+// Read a stream to its end, and return the number of bytes read
+static size_t drain(FILE *f)
+{
+    static char buf[BENCH_BUFSIZE];
+    size_t n, total = 0;
+    while ((n = fread(buf, 1, BENCH_BUFSIZE, f)) > 0)
+        total += n;
+    if (ferror(f))
+        diex("Read error while draining stream");
+    return total;
+}
+
+/**
+ * Tar generation. Only the fields that untar() looks at are filled in; long
+ * paths are stored in a pax header, like most image builders do.
+ */
+static void tarheader(struct mem *m, const char *path, char type, mode_t mode, size_t size, const char *linkpath)
+{
+    char buf[512] = { 0 };
+
+    snprintf(buf + 100, 8, "%07o", mode);
+    snprintf(buf + 108, 8, "%07o", getuid());
+    snprintf(buf + 116, 8, "%07o", getgid());
+    snprintf(buf + 124, 12, "%011lo", (unsigned long) size);
+    snprintf(buf + 136, 12, "%011lo", 1700000000UL);
+    buf[156] = type;
+    memcpy(buf + 257, "ustar", 6);
+    memcpy(buf + 263, "00", 2);
+    strncpy(buf, path, 100);
+    if (linkpath)
+        strncpy(buf + 157, linkpath, 100);
+
+    memset(buf + 148, ' ', 8);
+    unsigned sum = 0;
+    for (int i = 0; i < 512; i++)
+        sum += (unsigned char) buf[i];
+    snprintf(buf + 148, 8, "%06o", sum);
+
+    memput(m, buf, 512);
+}
+
+static void tarpad(struct mem *m, size_t size)
+{
+    static const char zero[512] = { 0 };
+    if (size % 512)
+        memput(m, zero, 512 - size % 512);
+}
+
+// Add a pax record "<len> <key>=<val>\n"; the length includes its own digits
+static void paxrecord(struct mem *m, const char *key, const char *val)
+{
+    int n = strlen(key) + strlen(val) + 3;
+    int len = n + 1;
+    while (snprintf(NULL, 0, "%d", len) + n != len)
+        len++;
+    char buf[PATH_MAX + 64];
+    snprintf(buf, sizeof(buf), "%d %s=%s\n", len, key, val);
+    memput(m, buf, len);
+}
+
+static void tarfile(struct mem *m, const char *path, char type, mode_t mode, size_t size, int pax)
+{
+    if (pax || strlen(path) >= 100) {
+        struct mem p = { 0 };
+        paxrecord(&p, "path", path);
+        paxrecord(&p, "mtime", "1700000000.123456789");
+        paxrecord(&p, "atime", "1700000000.5");
+        tarheader(m, "././@PaxHeader", 'x', 0644, p.n, NULL);
+        memput(m, p.buf, p.n);
+        tarpad(m, p.n);
+        memfree(&p);
+    }
+    tarheader(m, path, type, mode, size, NULL);
+
+    char buf[BENCH_BUFSIZE];
+    size_t left = size;
+    while (left) {
+        size_t n = left < BENCH_BUFSIZE ? left : BENCH_BUFSIZE;
+        fill(buf, n);
+        memput(m, buf, n);
+        left -= n;
+    }
+    tarpad(m, size);
+}
+
+// A symlink ('2') or hardlink ('1') to target
+static void tarlink(struct mem *m, const char *path, char type, const char *target)
+{
+    tarheader(m, path, type, 0777, 0, target);
+}
+
+static void tarend(struct mem *m)
+{
+    static const char zero[1024] = { 0 };
+    memput(m, zero, 1024);
+}
+
+/**
+ * The synthetic tar corpus: many tiny files, a few huge ones, deep paths and
+ * pax headers, each in its own archive such that they can be reported
+ * separately.
+ */
+static void gentiny(struct mem *m, int scale)
+{
+    char path[PATH_MAX];
+    for (int d = 0; d < 100 * scale; d++) {
+        snprintf(path, PATH_MAX, "tiny%03d", d);
+        tarfile(m, path, '5', 0755, 0, 0);
+        for (int i = 0; i < 200; i++) {
+            snprintf(path, PATH_MAX, "tiny%03d/file%03d.py", d, i);
+            tarfile(m, path, '0', 0644, xorshift() % 2048, 0);
+        }
+    }
+    tarend(m);
+}
+
+static void genhuge(struct mem *m, int scale)
+{
+    char path[PATH_MAX];
+    for (int i = 0; i < 2 * scale; i++) {
+        snprintf(path, PATH_MAX, "huge%d.bin", i);
+        tarfile(m, path, '0', 0644, 32 << 20, 0);
+    }
+    tarend(m);
+}
+
+static void gendeep(struct mem *m, int scale)
+{
+    char path[PATH_MAX];
+    for (int t = 0; t < 10 * scale; t++) {
+        int n = snprintf(path, PATH_MAX, "deep%02d", t);
+        tarfile(m, path, '5', 0755, 0, 0);
+        for (int d = 0; d < 40; d++) {
+            n += snprintf(path + n, PATH_MAX - n, "/level%02d", d);
+            tarfile(m, path, '5', 0755, 0, 0);
+            for (int i = 0; i < 10; i++) {
+                snprintf(path + n, PATH_MAX - n, "/file%d", i);
+                tarfile(m, path, '0', 0644, 512, 0);
+            }
+            path[n] = 0;
+        }
+    }
+    tarend(m);
+}
+
+static void genpax(struct mem *m, int scale)
+{
+    char path[PATH_MAX];
+    tarfile(m, "pax", '5', 0755, 0, 0);
+    for (int i = 0; i < 5000 * scale; i++) {
+        snprintf(path, PATH_MAX, "pax/file%05d", i);
+        tarfile(m, path, '0', 0644, 256, 1);
+    }
+    tarend(m);
+}
+
+/**
+ * File sizes in real layers are skewed: most files are small, a few are much
+ * larger. This returns a size around median, spread over 2^-spread to
+ * 2^spread times it.
+ */
+static size_t filesize(size_t median, int spread)
+{
+    int e = (int) (xorshift() % (2 * spread + 1)) - spread;
+    size_t size = e >= 0 ? median << e : median >> -e;
+    return size + xorshift() % (size / 2 + 1);
+}
+
+/**
+ * Realistic layer shapes, loosely modelled on what common images contain.
+ * A Debian base: binaries and shared libraries with their symlinks, and for
+ * every package documentation, man pages and translations.
+ */
+static void gendebian(struct mem *m, int scale)
+{
+    static const char *dirs[] = {
+        "usr", "usr/bin", "usr/lib", "usr/lib/x86_64-linux-gnu", "usr/share", "usr/share/doc", "usr/share/man",
+        "usr/share/man/man1", "usr/share/locale"
+    };
+    static const char *locales[] = { "de", "fr", "ja", "pt_BR", "zh_CN" };
+    char path[PATH_MAX], target[PATH_MAX];
+
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++)
+        tarfile(m, dirs[i], '5', 0755, 0, 0);
+    for (int l = 0; l < 5; l++) {
+        snprintf(path, PATH_MAX, "usr/share/locale/%s", locales[l]);
+        tarfile(m, path, '5', 0755, 0, 0);
+        snprintf(path, PATH_MAX, "usr/share/locale/%s/LC_MESSAGES", locales[l]);
+        tarfile(m, path, '5', 0755, 0, 0);
+    }
+
+    for (int p = 0; p < 300 * scale; p++) {
+        snprintf(path, PATH_MAX, "usr/share/doc/pkg%04d", p);
+        tarfile(m, path, '5', 0755, 0, 0);
+        snprintf(path, PATH_MAX, "usr/share/doc/pkg%04d/copyright", p);
+        tarfile(m, path, '0', 0644, filesize(1536, 1), 0);
+        snprintf(path, PATH_MAX, "usr/share/doc/pkg%04d/changelog.Debian.gz", p);
+        tarfile(m, path, '0', 0644, filesize(2048, 2), 0);
+        snprintf(path, PATH_MAX, "usr/share/man/man1/pkg%04d.1.gz", p);
+        tarfile(m, path, '0', 0644, filesize(3072, 2), 0);
+
+        snprintf(path, PATH_MAX, "usr/bin/pkg%04d", p);
+        tarfile(m, path, '0', 0755, filesize(64 << 10, 3), 0);
+        if (p % 3 == 0) {
+            snprintf(path, PATH_MAX, "usr/bin/pkg%04d-alias", p);
+            snprintf(target, PATH_MAX, "pkg%04d", p);
+            tarlink(m, path, '2', target);
+        }
+
+        snprintf(path, PATH_MAX, "usr/lib/x86_64-linux-gnu/libpkg%04d.so.1.0.0", p);
+        tarfile(m, path, '0', 0644, filesize(128 << 10, 3), 0);
+        snprintf(path, PATH_MAX, "usr/lib/x86_64-linux-gnu/libpkg%04d.so.1", p);
+        snprintf(target, PATH_MAX, "libpkg%04d.so.1.0.0", p);
+        tarlink(m, path, '2', target);
+
+        for (int l = 0; l < 5; l++) {
+            snprintf(path, PATH_MAX, "usr/share/locale/%s/LC_MESSAGES/pkg%04d.mo", locales[l], p);
+            tarfile(m, path, '0', 0644, filesize(8 << 10, 2), 0);
+        }
+    }
+    tarend(m);
+}
+
+// One npm package in dir, with nfiles modules
+static void genpackage(struct mem *m, const char *dir, int nfiles)
+{
+    char path[PATH_MAX];
+    tarfile(m, dir, '5', 0755, 0, 0);
+    snprintf(path, PATH_MAX, "%s/package.json", dir);
+    tarfile(m, path, '0', 0644, filesize(1024, 1), 0);
+    snprintf(path, PATH_MAX, "%s/README.md", dir);
+    tarfile(m, path, '0', 0644, filesize(4096, 2), 0);
+    snprintf(path, PATH_MAX, "%s/LICENSE", dir);
+    tarfile(m, path, '0', 0644, 1075, 0);
+    snprintf(path, PATH_MAX, "%s/lib", dir);
+    tarfile(m, path, '5', 0755, 0, 0);
+    for (int i = 0; i < nfiles; i++) {
+        snprintf(path, PATH_MAX, "%s/lib/module%02d.js", dir, i);
+        tarfile(m, path, '0', 0644, filesize(2048, 2), 0);
+    }
+}
+
+// A node_modules tree: many tiny JavaScript files in nested packages
+static void gennode(struct mem *m, int scale)
+{
+    char path[PATH_MAX];
+    tarfile(m, "app", '5', 0755, 0, 0);
+    tarfile(m, "app/node_modules", '5', 0755, 0, 0);
+    for (int p = 0; p < 400 * scale; p++) {
+        snprintf(path, PATH_MAX, "app/node_modules/pkg%04d", p);
+        genpackage(m, path, 20);
+        if (p % 4 == 0) {
+            snprintf(path, PATH_MAX, "app/node_modules/pkg%04d/node_modules", p);
+            tarfile(m, path, '5', 0755, 0, 0);
+            snprintf(path, PATH_MAX, "app/node_modules/pkg%04d/node_modules/dep%04d", p, p);
+            genpackage(m, path, 5);
+        }
+    }
+    tarend(m);
+}
+
+// A CUDA-like layer: a handful of huge shared libraries and many headers
+static void gencuda(struct mem *m, int scale)
+{
+    static const char *dirs[] = {
+        "usr", "usr/local", "usr/local/cuda", "usr/local/cuda/lib64", "usr/local/cuda/include"
+    };
+    char path[PATH_MAX], target[PATH_MAX];
+
+    for (size_t i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++)
+        tarfile(m, dirs[i], '5', 0755, 0, 0);
+    for (int i = 0; i < 6 * scale; i++) {
+        snprintf(path, PATH_MAX, "usr/local/cuda/lib64/libcuda%02d.so.12.4.99", i);
+        tarfile(m, path, '0', 0755, filesize(16 << 20, 1), 0);
+        snprintf(path, PATH_MAX, "usr/local/cuda/lib64/libcuda%02d.so.12", i);
+        snprintf(target, PATH_MAX, "libcuda%02d.so.12.4.99", i);
+        tarlink(m, path, '2', target);
+    }
+    for (int i = 0; i < 300 * scale; i++) {
+        snprintf(path, PATH_MAX, "usr/local/cuda/include/cuda%04d.h", i);
+        tarfile(m, path, '0', 0644, filesize(16 << 10, 2), 0);
+    }
+    tarend(m);
+}
+
+// Python site-packages: modules with their bytecode, extensions and metadata
+static void gensitepackages(struct mem *m, int scale)
+{
+    char path[PATH_MAX];
+    tarfile(m, "site-packages", '5', 0755, 0, 0);
+    for (int p = 0; p < 150 * scale; p++) {
+        snprintf(path, PATH_MAX, "site-packages/pkg%04d", p);
+        tarfile(m, path, '5', 0755, 0, 0);
+        snprintf(path, PATH_MAX, "site-packages/pkg%04d/__pycache__", p);
+        tarfile(m, path, '5', 0755, 0, 0);
+        snprintf(path, PATH_MAX, "site-packages/pkg%04d/__init__.py", p);
+        tarfile(m, path, '0', 0644, filesize(512, 2), 0);
+        for (int i = 0; i < 15; i++) {
+            snprintf(path, PATH_MAX, "site-packages/pkg%04d/module%02d.py", p, i);
+            tarfile(m, path, '0', 0644, filesize(6 << 10, 2), 0);
+            snprintf(path, PATH_MAX, "site-packages/pkg%04d/__pycache__/module%02d.cpython-311.pyc", p, i);
+            tarfile(m, path, '0', 0644, filesize(5 << 10, 2), 0);
+        }
+        if (p % 5 == 0) {
+            snprintf(path, PATH_MAX, "site-packages/pkg%04d/_speedups.cpython-311-x86_64-linux-gnu.so", p);
+            tarfile(m, path, '0', 0755, filesize(512 << 10, 2), 0);
+        }
+
+        snprintf(path, PATH_MAX, "site-packages/pkg%04d-1.0.dist-info", p);
+        tarfile(m, path, '5', 0755, 0, 0);
+        static const char *meta[] = { "METADATA", "RECORD", "WHEEL", "INSTALLER" };
+        for (int i = 0; i < 4; i++) {
+            snprintf(path, PATH_MAX, "site-packages/pkg%04d-1.0.dist-info/%s", p, meta[i]);
+            tarfile(m, path, '0', 0644, filesize(i < 2 ? 2048 : 64, 1), 0);
+        }
+    }
+    tarend(m);
+}
+
+static void gzip(struct mem *out, const struct mem *in, int level)
+{
+    z_stream strm = { 0 };
+    if (deflateInit2(&strm, level, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        diex("deflateInit2");
+
+    strm.next_in = (unsigned char *) in->buf;
+    strm.avail_in = in->n;
+
+    char buf[BENCH_BUFSIZE];
+    int ret;
+    do {
+        strm.next_out = (unsigned char *) buf;
+        strm.avail_out = BENCH_BUFSIZE;
+        ret = deflate(&strm, Z_FINISH);
+        if (ret == Z_STREAM_ERROR)
+            diex("deflate");
+        memput(out, buf, BENCH_BUFSIZE - strm.avail_out);
+    } while (ret != Z_STREAM_END);
+
+    deflateEnd(&strm);
+}
+
+// Encode in as HTTP chunked data, with chunk sizes drawn from sizes
+static void chunk(struct mem *out, const struct mem *in, const size_t *sizes, int nsizes)
+{
+    size_t off = 0;
+    char buf[32];
+    while (off < in->n) {
+        size_t n = sizes[xorshift() % nsizes];
+        if (n > in->n - off)
+            n = in->n - off;
+        memput(out, buf, snprintf(buf, 32, "%lx\r\n", n));
+        memput(out, in->buf + off, n);
+        memput(out, "\r\n", 2);
+        off += n;
+    }
+    memput(out, "0\r\n\r\n", 5);
+}
+
+static int rmentry(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    if (remove(path) == -1)
+        die("remove(%s)", path);
+    return 0;
+}
+
+static void rmtree(const char *path)
+{
+    if (nftw(path, rmentry, 64, FTW_DEPTH | FTW_PHYS) == -1)
+        die("nftw(%s)", path);
+}
+
+// Walk the entries of a tar stream, optionally writing them to a scratch directory
+static size_t runtar(FILE *f, const char *scratch)
+{
+    int dir_fd = -1;
+    if (scratch) {
+        if (mkdir(scratch, 0777) == -1)
+            die("mkdir(%s)", scratch);
+        dir_fd = open(scratch, O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd == -1)
+            die("open(%s)", scratch);
+    }
+
+    size_t entries = 0;
+    struct tarpool *pool = scratch ? tarpool(dir_fd) : NULL;
+    struct tarfile file = { 0 };
+    FILE *data;
+    while ((data = untar(f, &file))) {
+        if (scratch)
+            tarqueue(pool, &file, data);
+        fclose(data);
+        entries++;
+    }
+    free(file.sparse);
+
+    if (scratch) {
+        tarpoolclose(pool);
+        close(dir_fd);
+    }
+
+    return entries;
+}
+
+static void benchtar(const char *shape, const struct mem *tar, const char *scratch)
+{
+    char stage[64];
+
+    FILE *f = fmemopen(tar->buf, tar->n, "r");
+    double t = now();
+    size_t entries = runtar(f, NULL);
+    t = now() - t;
+    fclose(f);
+    snprintf(stage, 64, "untar (%s)", shape);
+    report(stage, t, tar->n, entries);
+
+    f = fmemopen(tar->buf, tar->n, "r");
+    t = now();
+    entries = runtar(f, scratch);
+    t = now() - t;
+    fclose(f);
+    rmtree(scratch);
+    snprintf(stage, 64, "untar+tarwrite (%s)", shape);
+    report(stage, t, tar->n, entries);
+}
+
+/**
+ * Open a counter of all system calls of this process and the threads it
+ * creates after, on the raw_syscalls:sys_enter tracepoint. Returns -1 if that
+ * is not possible, as when tracefs is not mounted or readable.
+ */
+static int syscallcounter()
+{
+    const char *ids[] = {
+        "/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+        "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"
+    };
+    long long id = -1;
+    for (size_t i = 0; id == -1 && i < sizeof(ids) / sizeof(ids[0]); i++) {
+        FILE *f = fopen(ids[i], "r");
+        if (!f)
+            continue;
+        if (fscanf(f, "%lld", &id) != 1)
+            id = -1;
+        fclose(f);
+    }
+    if (id == -1)
+        return -1;
+
+    struct perf_event_attr attr = {
+        .type = PERF_TYPE_TRACEPOINT,
+        .size = sizeof(attr),
+        .config = id,
+        .inherit = 1
+    };
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+/**
+ * Extract a realistic layer shape, and report besides the throughput the
+ * system calls per entry and the peak memory use. The system calls are all of
+ * them if they can be counted with perf_event_open(2), and otherwise only the
+ * reads and writes of /proc/self/io. The peak memory use is the growth of the
+ * peak RSS over the RSS before extraction, which already includes the input.
+ */
+static void benchshape(const char *shape, void (*gen)(struct mem *, int), int scale, const char *scratch)
+{
+    struct mem tar = { 0 };
+    gen(&tar, scale);
+
+    // Return freed memory, then reset the peak RSS of the process (see proc(5))
+    malloc_trim(0);
+    int fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (fd != -1) {
+        if (write(fd, "5", 1) == -1)
+            warn("Could not reset peak RSS");
+        close(fd);
+    }
+    long rss = procstat("status", "VmRSS");
+    int counter = syscallcounter();
+    long syscalls = counter == -1 ? procstat("io", "syscr") + procstat("io", "syscw") : 0;
+
+    FILE *f = fmemopen(tar.buf, tar.n, "r");
+    double t = now();
+    size_t entries = runtar(f, scratch);
+    t = now() - t;
+    fclose(f);
+
+    // The counts of the writer threads are added to the counter as they exit
+    if (counter == -1)
+        syscalls = procstat("io", "syscr") + procstat("io", "syscw") - syscalls;
+    else {
+        unsigned long long count;
+        if (read(counter, &count, sizeof(count)) != sizeof(count))
+            die("read(perf_event)");
+        syscalls = count;
+        close(counter);
+    }
+    long peak = procstat("status", "VmHWM") - rss;
+    rmtree(scratch);
+
+    char stage[64];
+    snprintf(stage, 64, "untar+tarwrite (%s)", shape);
+    printf("%-36s %10.1f MB/s %12.0f entries/s %8zu entries %6.2f %-14s %8.1f MB peak RSS\n", stage,
+           tar.n / t / 1e6, entries / t, entries, (double) syscalls / entries, counter == -1 ? "r+w/entry" : "syscalls/entry",
+           peak / 1024.0);
+    memfree(&tar);
+}
+
+int main(int argc, char **argv)
+{
+    int scale = argc > 1 ? atoi(argv[1]) : 1;
+    if (scale < 1)
+        diex("Usage: %s [SCALE]", argv[0]);
+
+    char scratch[PATH_MAX];
+    const char *tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    snprintf(scratch, PATH_MAX, "%s/poddos-bench.XXXXXX", tmpdir);
+    if (!mkdtemp(scratch))
+        die("mkdtemp(%s)", scratch);
+    char layer[PATH_MAX + 8];
+    snprintf(layer, sizeof(layer), "%s/layer", scratch);
+
+    // tarwrite() applies the modes from the archive verbatim
+    umask(0);
+
+    fprintf(stderr, "Generating inputs (scale %d)...\n", scale);
+    struct mem tiny = { 0 }, huge = { 0 }, deep = { 0 }, pax = { 0 };
+    gentiny(&tiny, scale);
+    genhuge(&huge, scale);
+    gendeep(&deep, scale);
+    genpax(&pax, scale);
+
+    // ftrunc: the plain stream wrapper, measured on the largest input
+    FILE *f = fmemopen(huge.buf, huge.n, "r");
+    double t = now();
+    FILE *g = ftrunc(f, huge.n, TRUNC_AUTOCLOSE);
+    size_t n = drain(g);
+    fclose(g);
+    report("ftrunc", now() - t, n, 0);
+
+    // fchunk: small, mixed and large chunks
+    const size_t small[] = { 1, 7, 64, 100, 511 };
+    const size_t mixed[] = { 100, 1024, 4096, 8192, 16384, 65536 };
+    const size_t large[] = { 1 << 20, 4 << 20 };
+    const struct {
+        const char *name;
+        const size_t *sizes;
+        int n;
+    } chunkings[] = {
+        { "fchunk (1-511 B chunks)", small, 5 },
+        { "fchunk (100 B-64 KiB chunks)", mixed, 6 },
+        { "fchunk (1-4 MiB chunks)", large, 2 },
+    };
+    for (int i = 0; i < 3; i++) {
+        struct mem body = { 0 };
+        chunk(&body, &tiny, chunkings[i].sizes, chunkings[i].n);
+        f = fmemopen(body.buf, body.n, "r");
+        t = now();
+        g = fchunk(f, CHUNK_AUTOCLOSE);
+        n = drain(g);
+        fclose(g);
+        report(chunkings[i].name, now() - t, n, 0);
+        memfree(&body);
+    }
+
+    // finfl: gzip at several levels; throughput is reported on the inflated size
+    const int levels[] = { 1, 6, 9 };
+    for (int i = 0; i < 3; i++) {
+        struct mem gz = { 0 };
+        gzip(&gz, &huge, levels[i]);
+        f = fmemopen(gz.buf, gz.n, "r");
+        t = now();
+        g = finfl(f, INFL_AUTOCLOSE);
+        n = drain(g);
+        fclose(g);
+
+        char stage[64];
+        snprintf(stage, 64, "finfl (level %d, ratio %.2f)", levels[i], (double) gz.n / huge.n);
+        report(stage, now() - t, n, 0);
+        memfree(&gz);
+    }
+
+    // untar on its own and together with tarwrite, for every shape
+    benchtar("tiny files", &tiny, layer);
+    benchtar("huge files", &huge, layer);
+    benchtar("deep paths", &deep, layer);
+    benchtar("pax headers", &pax, layer);
+
+    // The combined pipeline as pull() builds it: chunked(gzip(tar))
+    struct mem all = { 0 };
+    memput(&all, tiny.buf, tiny.n - 1024);
+    memput(&all, deep.buf, deep.n - 1024);
+    memput(&all, pax.buf, pax.n - 1024);
+    memput(&all, huge.buf, huge.n);
+    struct mem gz = { 0 }, body = { 0 };
+    gzip(&gz, &all, 6);
+    chunk(&body, &gz, mixed, 6);
+
+    f = fmemopen(body.buf, body.n, "r");
+    t = now();
+    g = finfl(fchunk(f, CHUNK_AUTOCLOSE), INFL_AUTOCLOSE);
+    n = runtar(g, layer);
+    fclose(g);
+    report("pipeline (fchunk+finfl+untar+tarwrite)", now() - t, all.n, n);
+    rmtree(layer);
+
+    memfree(&body);
+    memfree(&gz);
+    memfree(&all);
+    memfree(&tiny);
+    memfree(&huge);
+    memfree(&deep);
+    memfree(&pax);
+
+    // Realistic layer shapes, generated one at a time to keep memory use down
+    benchshape("debian base", gendebian, scale, layer);
+    benchshape("node_modules", gennode, scale, layer);
+    benchshape("cuda libraries", gencuda, scale, layer);
+    benchshape("python site-packages", gensitepackages, scale, layer);
+
+    if (rmdir(scratch) == -1)
+        die("rmdir(%s)", scratch);
+
+    return 0;
+}
@@ -0,0 +1,266 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/magic.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+
+#include "cgroup.h"
+#include "poddos.h"
+
+// Leaf of its cgroup that a process starting several containers moves to
+#define CGROUP_SUPERVISOR "poddos"
+
+// Settings of the cgroup of the container, as files in it and their contents
+static struct {
+    const char *file, *value;
+} *settings = NULL;
+static int nsettings = 0;
+
+// Path of the cgroup of the container, once it is created
+static char cgroup[PATH_MAX];
+
+void cgroupset(const char *file, const char *value)
+{
+    settings = realloc(settings, sizeof(*settings) * ++nsettings);
+    if (!settings)
+        die("realloc");
+    settings[nsettings - 1].file = file;
+    settings[nsettings - 1].value = value;
+}
+
+// Path of the cgroup of this process, false if there is no cgroup2 hierarchy
+static bool ownpath(char *path)
+{
+    struct statfs st;
+    if (statfs("/sys/fs/cgroup", &st) == -1 || st.f_type != CGROUP2_SUPER_MAGIC)
+        return false;
+
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (!f)
+        die("fopen(/proc/self/cgroup)");
+    char line[PATH_MAX + 4];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "0::/", 4))
+            continue;
+        line[strcspn(line, "\n")] = 0;
+        if (snprintf(path, PATH_MAX, "/sys/fs/cgroup%s", line + 3) >= PATH_MAX)
+            diex("Cgroup path too long: %s", line + 3);
+        found = true;
+    }
+    fclose(f);
+    return found;
+}
+
+static bool writeat(int dir_fd, const char *file, const char *value)
+{
+    int fd = openat(dir_fd, file, O_WRONLY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    bool ok = write(fd, value, strlen(value)) != -1;
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return ok;
+}
+
+/**
+ * Move this process (and so its future children) into a leaf of its cgroup,
+ * if that cgroup is delegated to us. A cgroup that has processes cannot
+ * enable controllers for its children, so this is needed to create the
+ * cgroups of containers as its children while poddos (or the daemon, or the
+ * zygote server) keeps running. Otherwise, nothing happens (and creating
+ * those cgroups fails later on).
+ */
+void cgroupsupervise()
+{
+    char path[PATH_MAX];
+    if (!ownpath(path))
+        return;
+    char *slash = strrchr(path, '/');
+    if (!strcmp(slash + 1, CGROUP_SUPERVISOR))
+        return;
+
+    int dir_fd = open(path, O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+        return;
+    if (mkdirat(dir_fd, CGROUP_SUPERVISOR, 0755) == 0 || errno == EEXIST) {
+        int fd = openat(dir_fd, CGROUP_SUPERVISOR, O_DIRECTORY | O_CLOEXEC);
+        if (fd != -1) {
+            writeat(fd, "cgroup.procs", "0");
+            close(fd);
+        }
+    }
+    close(dir_fd);
+}
+
+// Move the process pid (0 for this process) into the cgroup fd
+void cgroupenter(int fd, pid_t pid)
+{
+    char buf[16];
+    snprintf(buf, sizeof(buf), "%d", pid);
+    if (!writeat(fd, "cgroup.procs", buf))
+        die("could not move %d into the cgroup of %s", pid, name);
+}
+
+/**
+ * Reset the cgroup fd to the defaults of the kernel before the settings are
+ * applied, as it may be left from an earlier container with other settings.
+ * The files of a controller are missing if it is not enabled.
+ */
+static void liftlimits(int fd)
+{
+    // An empty cpuset means the cpus and memory nodes of the parent
+    static const struct {
+        const char *file, *value;
+    } defaults[] = {
+        { "cpu.max", "max" },
+        { "cpu.weight", "100" },
+        { "memory.max", "max" },
+        { "memory.high", "max" },
+        { "io.weight", "default 100" },
+        { "pids.max", "max" },
+        { "cpuset.cpus", "\n" },
+        { "cpuset.mems", "\n" }
+    };
+    for (size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++) {
+        if (!writeat(fd, defaults[i].file, defaults[i].value) && errno != ENOENT)
+            die("could not reset %s of %s", defaults[i].file, name);
+    }
+
+    // io.max has a line for every device with limits
+    int io_fd = openat(fd, "io.max", O_RDONLY | O_CLOEXEC);
+    if (io_fd == -1)
+        return;
+    FILE *f = fdopen(io_fd, "r");
+    if (!f)
+        die("fdopen(io.max)");
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        char value[64];
+        snprintf(value, sizeof(value), "%.*s rbps=max wbps=max riops=max wiops=max", (int) strcspn(line, " \n"), line);
+        if (!writeat(fd, "io.max", value))
+            die("could not set io.max of %s to %s", name, value);
+    }
+    fclose(f);
+}
+
+/**
+ * Remove the cgroup of the container once the process pid exited, from a
+ * child that outlives this process. That is the last process in the cgroup:
+ * pid 1 of the container, or poddos itself if it entered the cgroup (and so
+ * cannot remove it). The cgroup stays if it has other processes still, as
+ * when several zygotes of a container share it.
+ */
+void cgroupwatch(pid_t pid)
+{
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd == -1)
+        die("pidfd_open(%d)", pid);
+
+    fflush(NULL);
+    pid_t child = fork();
+    if (child == -1)
+        die("fork");
+    if (child > 0) {
+        close(pidfd);
+        return;
+    }
+
+    // Keep nothing open that others wait on (such as the output of poddos,
+    // or the pipe of a worker of the daemon), and leave the session so the
+    // signals of the terminal do not reach us
+    setsid();
+    int null = open("/dev/null", O_RDWR);
+    for (int fd = 0; fd < 3; fd++)
+        dup2(null, fd);
+    dup2(pidfd, 3);
+    syscall(SYS_close_range, 4, ~0U, 0);
+
+    struct pollfd pfd = {.fd = 3,.events = POLLIN };
+    while (poll(&pfd, 1, -1) == -1 && errno == EINTR);
+    rmdir(cgroup);
+    _exit(0);
+}
+
+/**
+ * Create the cgroup of the container (a child cgroup of the cgroup of poddos,
+ * named after the container), move this process into it if enter is set, and
+ * apply the settings. Returns a file descriptor of the cgroup (for
+ * CLONE_INTO_CGROUP), or -1 if there are no settings.
+ */
+int cgroupcreate(bool enter)
+{
+    if (!nsettings)
+        return -1;
+    if (!name)
+        diex("Resource limits are only supported for named containers");
+    if (!strcmp(name, CGROUP_SUPERVISOR))
+        diex("Resource limits are not supported for a container named %s, as that is the cgroup of poddos itself", name);
+
+    // poddos leaves its cgroup for a leaf of it, as it has to be empty to
+    // enable controllers for its children
+    if (enter)
+        cgroupsupervise();
+
+    char path[PATH_MAX];
+    if (!ownpath(path))
+        diex("Resource limits require the cgroup v2 hierarchy at /sys/fs/cgroup");
+    char *slash = strrchr(path, '/');
+    if (!strcmp(slash + 1, CGROUP_SUPERVISOR))
+        *slash = 0;
+    if (snprintf(cgroup, PATH_MAX, "%s/%s", path, name) >= PATH_MAX)
+        diex("Cgroup path too long: %s/%s", path, name);
+
+    // The watcher is forked before this process enters the cgroup, which it
+    // would keep busy otherwise
+    if (enter)
+        cgroupwatch(getpid());
+
+    int dir_fd = open(path, O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+        die("open(%s)", path);
+
+    // The cgroup may be removed in between by the watcher of an earlier
+    // container, and is then created again
+    int fd = -1;
+    while (fd == -1) {
+        if (mkdirat(dir_fd, name, 0755) == -1 && errno != EEXIST)
+            die("mkdir(%s)", cgroup);
+        fd = openat(dir_fd, name, O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1 && errno != ENOENT)
+            die("open(%s)", cgroup);
+        if (fd != -1 && enter && !writeat(fd, "cgroup.procs", "0")) {
+            if (errno != ENODEV)
+                die("could not move %d into the cgroup of %s", getpid(), name);
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    // The controller of a setting is the part of its file name before the dot
+    for (int i = 0; i < nsettings; i++) {
+        char controller[32];
+        snprintf(controller, sizeof(controller), "+%.*s", (int) strcspn(settings[i].file, "."), settings[i].file);
+        if (writeat(dir_fd, "cgroup.subtree_control", controller))
+            continue;
+        if (errno == EBUSY)
+            diex("Cannot enable the %s controller in %s, as it has other processes. "
+                 "Run poddos in a cgroup of its own, e.g. a systemd unit with Delegate=yes.", controller + 1, path);
+        die("could not enable the %s controller in %s", controller + 1, path);
+    }
+    close(dir_fd);
+
+    liftlimits(fd);
+    for (int i = 0; i < nsettings; i++) {
+        if (!writeat(fd, settings[i].file, settings[i].value))
+            die("could not set %s of %s to %s", settings[i].file, name, settings[i].value);
+    }
+    return fd;
+}
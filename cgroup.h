@@ -0,0 +1,13 @@
+#ifndef CGROUP_H
+#define CGROUP_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+void cgroupset(const char *file, const char *value);
+void cgroupsupervise();
+int cgroupcreate(bool enter);
+void cgroupenter(int fd, pid_t pid);
+void cgroupwatch(pid_t pid);
+
+#endif
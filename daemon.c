@@ -0,0 +1,511 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "daemon.h"
+#include "cgroup.h"
+#include "layer.h"
+#include "poddos.h"
+
+// Maximum size of a request or a reply
+#define DAEMON_MSGMAX 65536
+
+// Seconds a container gets to exit after SIGTERM, before it gets SIGKILL
+#define DAEMON_STOPTIMEOUT 10
+
+/**
+ * Requests are SOCK_SEQPACKET messages with NUL-terminated strings: "start",
+ * the name of the container and optionally a command to override the
+ * configured one; "stop" and the name; or "status". The reply is a single
+ * message of a status byte ('0' on success) followed by text.
+ */
+
+/**
+ * A container is starting while its worker has not reported the pid of pid 1
+ * yet: pipe is the end to read it from, and conn the connection to reply to
+ * once it has. Both are -1 otherwise.
+ */
+struct container {
+    char *name;
+    pid_t pid;
+    bool running;
+    int wstatus;
+    time_t deadline;
+    int pipe, conn;
+};
+
+static struct container *containers = NULL;
+static int ncontainers = 0;
+
+static struct sockaddr_un daemonaddr()
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX };
+    char *tmpdir = getenv("XDG_RUNTIME_DIR") ? getenv("XDG_RUNTIME_DIR") : "/tmp";
+    int ret = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/poddos/.daemon", tmpdir);
+    if (ret >= (int) sizeof(addr.sun_path))
+        diex("Path of the socket of the daemon too long");
+    return addr;
+}
+
+static time_t now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/**
+ * Ask a container to stop. pid 1 of a pid namespace only gets the signals it
+ * has a handler for, so it is killed if it does not exit in time.
+ */
+static void terminate(struct container *c)
+{
+    kill(c->pid, SIGTERM);
+    if (!c->deadline)
+        c->deadline = now() + DAEMON_STOPTIMEOUT;
+}
+
+// Kill the containers that did not stop in time, and return the poll timeout
+static int expire()
+{
+    int timeout = -1;
+    for (int i = 0; i < ncontainers; i++) {
+        struct container *c = &containers[i];
+        if (!c->running || !c->deadline)
+            continue;
+        if (now() >= c->deadline)
+            kill(c->pid, SIGKILL);
+        else
+            timeout = 1000;
+    }
+    return timeout;
+}
+
+static struct container *find(const char *container)
+{
+    for (int i = 0; i < ncontainers; i++) {
+        if (!strcmp(containers[i].name, container))
+            return &containers[i];
+    }
+    return NULL;
+}
+
+static void reply(int conn, bool ok, const char *fmt, ...)
+{
+    char buf[DAEMON_MSGMAX];
+    buf[0] = ok ? '0' : '1';
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + 1, sizeof(buf) - 1, fmt, ap);
+    va_end(ap);
+    if (n >= (int) sizeof(buf) - 1)
+        n = sizeof(buf) - 2;
+    send(conn, buf, n + 1, MSG_NOSIGNAL);
+}
+
+/**
+ * Start a container from its configuration, in a fork of the daemon so the
+ * configuration is parsed in a clean state. pid 1 of the container is
+ * reparented to the daemon (as subreaper) when the fork exits. Returns the end
+ * of a pipe on which the fork writes that pid, or closes it if it failed.
+ */
+static int spawn(const char *container, char **cmd)
+{
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC | O_NONBLOCK) == -1)
+        die("pipe");
+
+    fflush(NULL);
+    pid_t worker = fork();
+    if (worker == -1)
+        die("fork");
+    if (worker == 0) {
+        close(pipefd[0]);
+
+        // The container should not inherit the signals blocked by the daemon
+        sigset_t mask;
+        sigemptyset(&mask);
+        if (sigprocmask(SIG_SETMASK, &mask, NULL) == -1)
+            die("sigprocmask");
+
+        int ncmd = 0;
+        while (cmd[ncmd])
+            ncmd++;
+        char **argv = calloc(ncmd + 8, sizeof(char *));
+        if (!argv)
+            die("calloc");
+        int argc = 0;
+        argv[argc++] = "poddos";
+        argv[argc++] = "-l";
+        argv[argc++] = strdup(layer_path);
+        argv[argc++] = "-n";
+        argv[argc++] = (char *) container;
+        argv[argc++] = "start";
+        if (ncmd)
+            argv[argc++] = "--";
+        for (int i = 0; i < ncmd; i++)
+            argv[argc++] = cmd[i];
+
+        supervised = true;
+        poddos(argc, argv);
+        if (write(pipefd[1], &spawned, sizeof(spawned)) != sizeof(spawned))
+            die("write(pipefd)");
+        quick_exit(0);
+    }
+    close(pipefd[1]);
+    return pipefd[0];
+}
+
+/**
+ * Finish the start of the container c if its worker reported. The worker
+ * itself is collected by reap(), like any other child.
+ */
+static void finish(struct container *c)
+{
+    pid_t pid;
+    ssize_t n = read(c->pipe, &pid, sizeof(pid));
+    if (n == -1 && errno == EAGAIN)
+        return;
+    close(c->pipe);
+    c->pipe = -1;
+
+    if (n != sizeof(pid))
+        reply(c->conn, false, "Could not start %s, see the output of the daemon\n", c->name);
+    else {
+        c->pid = pid;
+        c->running = true;
+        c->wstatus = 0;
+        c->deadline = 0;
+        reply(c->conn, true, "Started %s (pid %d)\n", c->name, pid);
+    }
+    close(c->conn);
+    c->conn = -1;
+
+    // Forget a container that never ran
+    if (!c->running && !c->pid) {
+        free(c->name);
+        *c = containers[--ncontainers];
+    }
+}
+
+static void finishall()
+{
+    for (int i = ncontainers - 1; i >= 0; i--) {
+        if (containers[i].pipe != -1)
+            finish(&containers[i]);
+    }
+}
+
+/**
+ * Start a container, without waiting for it: the reply is sent on a duplicate
+ * of conn once the worker reports, from the event loop.
+ */
+static void start(int conn, const char *container, char **cmd)
+{
+    struct container *c = find(container);
+    if (c && c->running) {
+        reply(conn, false, "%s is running already\n", container);
+        return;
+    }
+    if (c && c->pipe != -1) {
+        reply(conn, false, "%s is starting already\n", container);
+        return;
+    }
+
+    if (!c) {
+        containers = realloc(containers, sizeof(struct container) * ++ncontainers);
+        if (!containers)
+            die("realloc");
+        c = &containers[ncontainers - 1];
+        memset(c, 0, sizeof(struct container));
+        c->name = strdup(container);
+        if (!c->name)
+            die("strdup");
+    }
+    c->conn = fcntl(conn, F_DUPFD_CLOEXEC, 0);
+    if (c->conn == -1)
+        die("dup");
+    c->pipe = spawn(container, cmd);
+}
+
+static void status(int conn)
+{
+    char buf[DAEMON_MSGMAX - 1];
+    size_t len = 0;
+    buf[0] = 0;
+    for (int i = 0; i < ncontainers && len < sizeof(buf); i++) {
+        struct container *c = &containers[i];
+        if (c->pipe != -1)
+            len += snprintf(buf + len, sizeof(buf) - len, "%s\tstarting\n", c->name);
+        else if (c->running)
+            len += snprintf(buf + len, sizeof(buf) - len, "%s\trunning (pid %d)\n", c->name, c->pid);
+        else if (WIFSIGNALED(c->wstatus))
+            len += snprintf(buf + len, sizeof(buf) - len, "%s\tkilled (signal %d, %s)\n", c->name,
+                            WTERMSIG(c->wstatus), strsignal(WTERMSIG(c->wstatus)));
+        else
+            len += snprintf(buf + len, sizeof(buf) - len, "%s\texited (status %d)\n", c->name, WEXITSTATUS(c->wstatus));
+    }
+    reply(conn, true, "%s", buf);
+}
+
+static void handle(int conn)
+{
+    static char buf[DAEMON_MSGMAX];
+    ssize_t n = recv(conn, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+        return;
+    buf[n] = 0;
+
+    // Only the owner of the daemon may start and stop its containers
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+        die("getsockopt(SO_PEERCRED)");
+    if (cred.uid != geteuid()) {
+        reply(conn, false, "Permission denied\n");
+        return;
+    }
+
+    // Split the request into its strings
+    static char *args[DAEMON_MSGMAX / 2];
+    int nargs = 0;
+    for (char *c = buf; c < buf + n; c += strlen(c) + 1) {
+        if (nargs == (int) (sizeof(args) / sizeof(args[0])) - 1) {
+            reply(conn, false, "Too many arguments\n");
+            return;
+        }
+        args[nargs++] = c;
+    }
+    args[nargs] = NULL;
+
+    if (nargs >= 2 && !strcmp(args[0], "start"))
+        start(conn, args[1], args + 2);
+    else if (nargs == 2 && !strcmp(args[0], "stop")) {
+        struct container *c = find(args[1]);
+        if (c && c->pipe != -1)
+            reply(conn, false, "%s is still starting\n", args[1]);
+        else if (!c || !c->running)
+            reply(conn, false, "%s is not running\n", args[1]);
+        else {
+            terminate(c);
+            reply(conn, true, "Stopping %s\n", args[1]);
+        }
+    } else if (nargs == 1 && !strcmp(args[0], "status"))
+        status(conn);
+    else
+        reply(conn, false, "Invalid request\n");
+}
+
+static struct container *running(pid_t pid)
+{
+    for (int i = 0; i < ncontainers; i++) {
+        if (containers[i].running && containers[i].pid == pid)
+            return &containers[i];
+    }
+    return NULL;
+}
+
+// Collect the containers that exited, and the workers that started them
+static void reap()
+{
+    pid_t pid;
+    int wstatus;
+    while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+        // pid 1 of a container may exit before its start is finished, but the
+        // worker has written its pid by then
+        struct container *c = running(pid);
+        if (!c) {
+            finishall();
+            c = running(pid);
+        }
+        if (!c)
+            continue;
+
+        c->running = false;
+        c->wstatus = wstatus;
+
+        char path[PATH_MAX];
+        char *tmpdir = getenv("XDG_RUNTIME_DIR") ? getenv("XDG_RUNTIME_DIR") : "/tmp";
+        snprintf(path, PATH_MAX, "%s/poddos/%s", tmpdir, c->name);
+        unlink(path);
+    }
+}
+
+/**
+ * Poll the socket sock (if not -1), the signals sfd and the workers of the
+ * containers that are starting, for at most timeout milliseconds. Returns the
+ * revents of sock and sfd; the starts that the workers reported are finished.
+ */
+static void pollall(int sock, int sfd, int timeout, short *revents)
+{
+    static struct pollfd *pfds = NULL;
+    pfds = realloc(pfds, sizeof(struct pollfd) * (ncontainers + 2));
+    if (!pfds)
+        die("realloc");
+    pfds[0] = (struct pollfd) {.fd = sock,.events = POLLIN };
+    pfds[1] = (struct pollfd) {.fd = sfd,.events = POLLIN };
+    int n = 2;
+    for (int i = 0; i < ncontainers; i++) {
+        if (containers[i].pipe != -1)
+            pfds[n++] = (struct pollfd) {.fd = containers[i].pipe,.events = POLLIN };
+    }
+
+    revents[0] = revents[1] = 0;
+    if (poll(pfds, n, timeout) == -1) {
+        if (errno == EINTR)
+            return;
+        die("poll");
+    }
+    revents[0] = pfds[0].revents;
+    revents[1] = pfds[1].revents;
+    for (int i = 2; i < n; i++) {
+        if (pfds[i].revents)
+            finishall();
+    }
+}
+
+/**
+ * Run containers on request, as children of this process, until SIGTERM or
+ * SIGINT. Containers do not have a relay process: their output goes to the
+ * output of the daemon, and they are started in a fork of the daemon, which
+ * has the subordinate ids parsed already.
+ */
+void supervise()
+{
+    if (prctl(PR_SET_CHILD_SUBREAPER, 1) == -1)
+        die("prctl(PR_SET_CHILD_SUBREAPER)");
+    loadsubids();
+
+    // Containers with resource limits get a child cgroup of the cgroup of the
+    // daemon
+    cgroupsupervise();
+
+    // Containers do not get any input
+    int null = open("/dev/null", O_RDONLY);
+    if (null == -1 || dup2(null, STDIN_FILENO) == -1)
+        die("open(/dev/null)");
+    close(null);
+
+    struct sockaddr_un addr = daemonaddr();
+    char *dir = strdup(addr.sun_path);
+    if (!dir)
+        die("strdup");
+    *strrchr(dir, '/') = 0;
+    if (mkdir(dir, 0777) == -1 && errno != EEXIST)
+        die("mkdir(%s)", dir);
+    free(dir);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        die("socket");
+    if (unlink(addr.sun_path) == -1 && errno != ENOENT)
+        die("unlink(%s)", addr.sun_path);
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        die("bind(%s)", addr.sun_path);
+    if (listen(sock, 16) == -1)
+        die("listen");
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+        die("sigprocmask");
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sfd == -1)
+        die("signalfd");
+
+    short revents[2];
+    for (;;) {
+        pollall(sock, sfd, expire(), revents);
+        if (revents[0] & POLLIN) {
+            int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+            if (conn == -1)
+                die("accept");
+            handle(conn);
+            close(conn);
+        }
+        if (revents[1] & POLLIN) {
+            struct signalfd_siginfo fdsi;
+            if (read(sfd, &fdsi, sizeof(fdsi)) != sizeof(fdsi))
+                die("read(sfd)");
+            if (fdsi.ssi_signo != SIGCHLD)
+                break;
+            reap();
+        }
+    }
+
+    // Stop all containers, and wait for them. Containers that are starting
+    // are stopped once they are
+    unlink(addr.sun_path);
+    close(sock);
+    for (;;) {
+        bool busy = false;
+        for (int i = 0; i < ncontainers; i++) {
+            if (containers[i].running && !containers[i].deadline)
+                terminate(&containers[i]);
+            busy = busy || containers[i].running || containers[i].pipe != -1;
+        }
+        if (!busy)
+            break;
+
+        pollall(-1, sfd, expire(), revents);
+        if (revents[1] & POLLIN) {
+            struct signalfd_siginfo fdsi;
+            if (read(sfd, &fdsi, sizeof(fdsi)) != sizeof(fdsi))
+                die("read(sfd)");
+        }
+        reap();
+    }
+}
+
+/**
+ * Send a request to the daemon and print its reply. Returns the exit status
+ * for poddos.
+ */
+int daemonrequest(char **request)
+{
+    char buf[DAEMON_MSGMAX];
+    size_t len = 0;
+    for (int i = 0; request[i]; i++) {
+        size_t n = strlen(request[i]) + 1;
+        if (len + n > sizeof(buf))
+            diex("Request too long");
+        memcpy(buf + len, request[i], n);
+        len += n;
+    }
+
+    struct sockaddr_un addr = daemonaddr();
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        die("socket");
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        die("connect(%s)", addr.sun_path);
+    if (send(sock, buf, len, 0) == -1)
+        die("send");
+
+    ssize_t n = recv(sock, buf, sizeof(buf) - 1, 0);
+    if (n <= 0)
+        diex("No reply from the daemon");
+    buf[n] = 0;
+    close(sock);
+
+    fputs(buf + 1, buf[0] == '0' ? stdout : stderr);
+    return buf[0] == '0' ? EXIT_SUCCESS : EXIT_FAILURE;
+}
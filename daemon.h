@@ -0,0 +1,7 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+void supervise();
+int daemonrequest(char **request);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,342 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "flatten.h"
+#include "layer.h"
+#include "prune.h"
+#include "poddos.h"
+
+/**
+ * Name of the snapshot of the lower directories dirs in .flat: an FNV-1a hash
+ * of their paths (including the terminating NULs) from the bottom to the top,
+ * each followed by the size and modification time of the index of the layer.
+ * A layer that is pulled again under the same name thus gets a new snapshot.
+ * Only pulled layers have an index that changes with every change to them,
+ * so there is no name if one of dirs is not a pulled layer with an index;
+ * returns the number of that directory then, and -1 otherwise.
+ */
+int flatname(char **dirs, int ndirs, char *buf, size_t n)
+{
+    int index_fd = openat(layer_fd, ".index", O_DIRECTORY | O_CLOEXEC);
+    size_t len = strlen(layer_path);
+
+    int ret = -1;
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < ndirs; i++) {
+        const char *dir = dirs[i];
+        for (const char *c = dir; *c; c++)
+            hash = (hash ^ (unsigned char) *c) * 1099511628211ull;
+        hash *= 1099511628211ull;
+
+        struct stat st;
+        bool layer = !strncmp(dir, layer_path, len) && dir[len] == '/' && !strchr(dir + len + 1, '/');
+        if (!layer || index_fd == -1 || fstatat(index_fd, dir + len + 1, &st, 0) == -1) {
+            ret = i;
+            break;
+        }
+        uint64_t stamp[] = { st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+        for (size_t j = 0; j < sizeof(stamp); j++)
+            hash = (hash ^ ((unsigned char *) stamp)[j]) * 1099511628211ull;
+    }
+    if (ret == -1)
+        snprintf(buf, n, "%016llx", (unsigned long long) hash);
+    else if (n)
+        buf[0] = 0;
+
+    if (index_fd != -1)
+        close(index_fd);
+    return ret;
+}
+
+// Remove name from dir_fd, whether it is a directory or not
+static void removeat(int dir_fd, const char *name, const struct stat *st)
+{
+    if (S_ISDIR(st->st_mode)) {
+        int fd = openat(dir_fd, name, O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1 || emptydir(fd) == -1)
+            die("could not empty %s", name);
+        close(fd);
+        if (unlinkat(dir_fd, name, AT_REMOVEDIR) == -1)
+            die("rmdir(%s)", name);
+    } else if (unlinkat(dir_fd, name, 0) == -1)
+        die("unlink(%s)", name);
+}
+
+// Whether a directory hides the directories below it (see overlayfs.rst)
+static bool opaque(int fd)
+{
+    char c;
+    return fgetxattr(fd, "user.overlay.opaque", &c, 1) == 1 && c == 'y';
+}
+
+/**
+ * Copy what cannot be hardlinked, because the layer is on another file system
+ * or the file has too many links already.
+ */
+static void copyat(int src_fd, int dst_fd, const char *name, const struct stat *st)
+{
+    if (S_ISLNK(st->st_mode)) {
+        char target[PATH_MAX];
+        ssize_t n = readlinkat(src_fd, name, target, PATH_MAX - 1);
+        if (n == -1)
+            die("readlink(%s)", name);
+        target[n] = 0;
+        if (symlinkat(target, dst_fd, name) == -1)
+            die("symlink(%s)", name);
+        if (fchownat(dst_fd, name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW) == -1)
+            die("chown(%s)", name);
+        return;
+    }
+    if (!S_ISREG(st->st_mode))
+        diex("Cannot link or copy %s", name);
+
+    int in = openat(src_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in == -1)
+        die("open(%s)", name);
+    int out = openat(dst_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (out == -1)
+        die("open(%s)", name);
+    for (off_t left = st->st_size; left > 0;) {
+        ssize_t n = copy_file_range(in, NULL, out, NULL, left, 0);
+        if (n == -1)
+            die("copy_file_range(%s)", name);
+        if (n == 0)
+            break;
+        left -= n;
+    }
+
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    if (fchown(out, st->st_uid, st->st_gid) == -1 || fchmod(out, st->st_mode & 07777) == -1
+        || futimens(out, times) == -1)
+        die("could not copy the attributes of %s", name);
+    close(in);
+    close(out);
+}
+
+/**
+ * Apply the layer src_fd onto the snapshot dst_fd, as overlayfs would show
+ * it: entries replace what is below them, whiteouts remove it, and the
+ * contents of directories are merged unless they are opaque. Returns the
+ * number of entries.
+ */
+static int merge(int src_fd, int dst_fd)
+{
+    int n = 0;
+
+    int fd = dup(src_fd);
+    if (fd == -1)
+        die("dup");
+    DIR *dir = fdopendir(fd);
+    if (!dir)
+        die("fdopendir");
+
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        const char *name = entry->d_name;
+        if (!strcmp(name, ".") || !strcmp(name, ".."))
+            continue;
+
+        struct stat st, dst_st;
+        if (fstatat(src_fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            die("stat(%s)", name);
+        bool exists = fstatat(dst_fd, name, &dst_st, AT_SYMLINK_NOFOLLOW) == 0;
+        if (!exists && errno != ENOENT)
+            die("stat(%s)", name);
+        n++;
+
+        // Whiteouts only remove what is below them
+        if (S_ISCHR(st.st_mode) && st.st_rdev == makedev(0, 0)) {
+            if (exists)
+                removeat(dst_fd, name, &dst_st);
+            continue;
+        }
+
+        if (!S_ISDIR(st.st_mode)) {
+            if (exists)
+                removeat(dst_fd, name, &dst_st);
+            if (linkat(src_fd, name, dst_fd, name, 0) == -1) {
+                if (errno != EXDEV && errno != EMLINK)
+                    die("link(%s)", name);
+                copyat(src_fd, dst_fd, name, &st);
+            }
+            continue;
+        }
+
+        int sub_fd = openat(src_fd, name, O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (sub_fd == -1)
+            die("open(%s)", name);
+        if (exists && (!S_ISDIR(dst_st.st_mode) || opaque(sub_fd))) {
+            removeat(dst_fd, name, &dst_st);
+            exists = false;
+        }
+        if (!exists && mkdirat(dst_fd, name, 0700) == -1)
+            die("mkdir(%s)", name);
+        int dst_sub_fd = openat(dst_fd, name, O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dst_sub_fd == -1)
+            die("open(%s)", name);
+
+        n += merge(sub_fd, dst_sub_fd);
+
+        // The attributes of the topmost directory are the ones that are shown,
+        // and are set after its contents, as those change its times
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        if (fchown(dst_sub_fd, st.st_uid, st.st_gid) == -1 || fchmod(dst_sub_fd, st.st_mode & 07777) == -1
+            || futimens(dst_sub_fd, times) == -1)
+            die("could not set the attributes of %s", name);
+
+        close(sub_fd);
+        close(dst_sub_fd);
+    }
+
+    closedir(dir);
+    return n;
+}
+
+/**
+ * Materialize the merged view of the lower directories in .flat, such that a
+ * container can use it as its single lower directory. Files are hardlinked
+ * from the layers where possible, so this costs little more than the
+ * directories themselves.
+ */
+void flatten(bool force)
+{
+    if (nlowerdir < 2)
+        diex("Nothing to flatten, there are fewer than two lower directories");
+
+    char flat[32], tmp[40], list[40];
+    int bad = flatname(lowerdirs, nlowerdir, flat, sizeof(flat));
+    if (bad != -1)
+        diex("Only pulled layers can be flattened, and %s is not one (or its pull did not complete)", lowerdirs[bad]);
+    snprintf(tmp, sizeof(tmp), ".%s.tmp", flat);
+    snprintf(list, sizeof(list), "%s.layers", flat);
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1)
+        die("pipe");
+
+    struct clone_args cl_args = { 0 };
+    cl_args.flags = CLONE_NEWUSER;
+    cl_args.exit_signal = SIGCHLD;
+
+    // Explicitly flush the streams such that we can do printf in the child
+    // (otherwise buffering may give double output).
+    fflush(NULL);
+
+    pid_t pid = syscall(SYS_clone3, &cl_args, sizeof(struct clone_args));
+    if (pid == -1)
+        die("clone3");
+    if (pid == 0) {
+        // Child, wait for the parent to setup the uid / gid map
+        close(pipefd[1]);
+        char buf;
+        if (read(pipefd[0], &buf, 1) == -1)
+            die("read(pipefd)");
+        close(pipefd[0]);
+
+        if (mkdirat(layer_fd, ".flat", 0777) == -1 && errno != EEXIST)
+            die("mkdir(.flat)");
+        int flat_fd = openat(layer_fd, ".flat", O_DIRECTORY | O_CLOEXEC);
+        if (flat_fd == -1)
+            die("open(.flat)");
+
+        struct stat st;
+        if (fstatat(flat_fd, flat, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            if (!force) {
+                printf("Already flattened into .flat/%s.\n", flat);
+                exit(0);
+            }
+            removeat(flat_fd, flat, &st);
+        }
+
+        // Build the snapshot under a temporary name, such that it only
+        // appears once complete
+        if (fstatat(flat_fd, tmp, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            removeat(flat_fd, tmp, &st);
+        if (mkdirat(flat_fd, tmp, 0700) == -1)
+            die("mkdir(%s)", tmp);
+        int dst_fd = openat(flat_fd, tmp, O_DIRECTORY | O_CLOEXEC);
+        if (dst_fd == -1)
+            die("open(%s)", tmp);
+
+        int n = 0;
+        for (int i = 0; i < nlowerdir; i++) {
+            int src_fd = open(lowerdirs[i], O_DIRECTORY | O_CLOEXEC);
+            if (src_fd == -1)
+                die("open(%s)", lowerdirs[i]);
+            n += merge(src_fd, dst_fd);
+            if (i == nlowerdir - 1) {
+                if (fstat(src_fd, &st) == -1)
+                    die("fstat(%s)", lowerdirs[i]);
+                if (fchown(dst_fd, st.st_uid, st.st_gid) == -1 || fchmod(dst_fd, st.st_mode & 07777) == -1)
+                    die("could not set the attributes of %s", tmp);
+            }
+            close(src_fd);
+        }
+        close(dst_fd);
+
+        // Record the lower directories (NUL-terminated), such that prune can
+        // tell whether the snapshot is still in use
+        int list_fd = openat(flat_fd, list, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (list_fd == -1)
+            die("open(%s)", list);
+        for (int i = 0; i < nlowerdir; i++) {
+            size_t len = strlen(lowerdirs[i]) + 1;
+            if (write(list_fd, lowerdirs[i], len) != (ssize_t) len)
+                die("write(%s)", list);
+        }
+        close(list_fd);
+
+        if (renameat(flat_fd, tmp, flat_fd, flat) == -1)
+            die("rename(%s, %s)", tmp, flat);
+        close(flat_fd);
+
+        printf("Flattened %d layers (%d entries) into .flat/%s.\n", nlowerdir, n, flat);
+        exit(0);
+    }
+    makeugmap(pid);
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    int wstatus;
+    if (wait(&wstatus) == -1)
+        die("wait");
+    if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus))
+        diex("Child crashed (exit status %d).", WEXITSTATUS(wstatus));
+}
+
+/**
+ * Replace the lower directories by their snapshot in .flat, if it was made.
+ * Looking up a path then probes one directory instead of all layers.
+ */
+void flatlower()
+{
+    if (nlowerdir < 2)
+        return;
+
+    char path[PATH_MAX];
+    char flat[32];
+    if (flatname(lowerdirs, nlowerdir, flat, sizeof(flat)) != -1)
+        return;
+    int ret = snprintf(path, PATH_MAX, "%s/.flat/%s", layer_path, flat);
+    if (ret >= PATH_MAX || access(path, F_OK) == -1)
+        return;
+
+    for (int i = 0; i < nlowerdir; i++)
+        free(lowerdirs[i]);
+    nlowerdir = 0;
+    addlowerdir(path);
+}
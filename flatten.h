@@ -0,0 +1,11 @@
+#ifndef FLATTEN_H
+#define FLATTEN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+int flatname(char **dirs, int ndirs, char *buf, size_t n);
+void flatten(bool force);
+void flatlower();
+
+#endif
\ No newline at end of file
@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "index.h"
+#include "poddos.h"
+
+#define INDEX_MAGIC "poddosix"
+
+/**
+ * Entries of an index in the order in which they are extracted. Hashes may be
+ * filled in by the writer threads, so all access is under the lock.
+ */
+struct indexbuilder {
+    pthread_mutex_t lock;
+
+    size_t count, cap;
+    struct indexentry *entries;
+
+    size_t len, pathcap;
+    char *paths;
+};
+
+struct indexbuilder *indexnew()
+{
+    struct indexbuilder *b = calloc(1, sizeof(struct indexbuilder));
+    if (!b)
+        die("calloc");
+    pthread_mutex_init(&b->lock, NULL);
+    return b;
+}
+
+/**
+ * Add <file> to the index and return its number. Paths are stored without
+ * leading ./ or /, and without trailing /, as in "usr/bin".
+ */
+size_t indexadd(struct indexbuilder *b, const struct tarfile *file)
+{
+    const char *path = file->path;
+    while (path[0] == '/' || (path[0] == '.' && path[1] == '/'))
+        path += path[0] == '/' ? 1 : 2;
+    size_t n = strlen(path);
+    while (n > 0 && path[n - 1] == '/')
+        n--;
+
+    pthread_mutex_lock(&b->lock);
+    if (b->count == b->cap) {
+        b->cap = b->cap ? 2 * b->cap : 1024;
+        b->entries = realloc(b->entries, b->cap * sizeof(struct indexentry));
+        if (!b->entries)
+            die("realloc");
+    }
+    if (b->len + n + 1 > b->pathcap) {
+        while (b->len + n + 1 > b->pathcap)
+            b->pathcap = b->pathcap ? 2 * b->pathcap : 65536;
+        b->paths = realloc(b->paths, b->pathcap);
+        if (!b->paths)
+            die("realloc");
+    }
+
+    struct indexentry *e = &b->entries[b->count];
+    memset(e, 0, sizeof(struct indexentry));
+    e->size = file->size;
+    e->path = b->len;
+    e->mode = file->mode;
+    e->type = file->type;
+
+    memcpy(b->paths + b->len, path, n);
+    b->paths[b->len + n] = 0;
+    b->len += n + 1;
+
+    size_t ret = b->count++;
+    pthread_mutex_unlock(&b->lock);
+    return ret;
+}
+
+void indexhash(struct indexbuilder *b, size_t i, const unsigned char *hash)
+{
+    pthread_mutex_lock(&b->lock);
+    memcpy(b->entries[i].hash, hash, INDEX_HASHLEN);
+    pthread_mutex_unlock(&b->lock);
+}
+
+// Order on the path, and on the order of extraction for equal paths
+static int indexcmp(const void *a, const void *b, void *arg)
+{
+    const struct indexbuilder *ix = (const struct indexbuilder *) arg;
+    size_t i = *(const size_t *) a, j = *(const size_t *) b;
+    int ret = strcmp(ix->paths + ix->entries[i].path, ix->paths + ix->entries[j].path);
+    if (ret)
+        return ret;
+    return i < j ? -1 : i > j;
+}
+
+static void writeall(FILE * f, const void *buf, size_t n, const char *name)
+{
+    if (fwrite(buf, 1, n, f) != n)
+        die("write(%s)", name);
+}
+
+/**
+ * Write the index as <name> in dir_fd. It is written to a temporary file
+ * first, so <name> is either absent or complete; with durable, also after a
+ * crash. If a path occurs multiple times, only the last entry is kept, as
+ * that is what extraction leaves.
+ */
+void indexwrite(struct indexbuilder *b, int dir_fd, const char *name, unsigned flags, bool durable)
+{
+    pthread_mutex_lock(&b->lock);
+
+    size_t *order = malloc(b->count * sizeof(size_t) + 1);
+    if (!order)
+        die("malloc");
+    for (size_t i = 0; i < b->count; i++)
+        order[i] = i;
+    qsort_r(order, b->count, sizeof(size_t), indexcmp, b);
+
+    size_t count = 0;
+    for (size_t i = 0; i < b->count; i++) {
+        if (i + 1 < b->count && !strcmp(b->paths + b->entries[order[i]].path, b->paths + b->entries[order[i + 1]].path))
+            continue;
+        order[count++] = order[i];
+    }
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, PATH_MAX, ".%s.tmp", name);
+    int fd = openat(dir_fd, tmp, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        die("open(%s)", tmp);
+    FILE *f = fdopen(fd, "w");
+    if (!f)
+        die("fdopen(%s)", tmp);
+
+    struct indexheader header = { INDEX_MAGIC, INDEX_VERSION, flags, count, 0 };
+    for (size_t i = 0; i < count; i++) {
+        if (b->entries[order[i]].type == '0' || b->entries[order[i]].type == '7')
+            header.bytes += b->entries[order[i]].size;
+    }
+    writeall(f, &header, sizeof(header), tmp);
+
+    // Paths are renumbered, as the duplicates are left out
+    uint32_t off = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct indexentry e = b->entries[order[i]];
+        e.path = off;
+        off += strlen(b->paths + b->entries[order[i]].path) + 1;
+        writeall(f, &e, sizeof(e), tmp);
+    }
+    for (size_t i = 0; i < count; i++) {
+        const char *path = b->paths + b->entries[order[i]].path;
+        writeall(f, path, strlen(path) + 1, tmp);
+    }
+
+    if (fflush(f) || (durable && fsync(fd) == -1))
+        die("write(%s)", tmp);
+    if (fclose(f))
+        die("close(%s)", tmp);
+    if (renameat(dir_fd, tmp, dir_fd, name) == -1)
+        die("rename(%s, %s)", tmp, name);
+
+    free(order);
+    pthread_mutex_unlock(&b->lock);
+}
+
+void indexfree(struct indexbuilder *b)
+{
+    pthread_mutex_destroy(&b->lock);
+    free(b->entries);
+    free(b->paths);
+    free(b);
+}
+
+/**
+ * Map the index <name> in dir_fd into memory. Returns -1 if there is no such
+ * index, or (with a warning) if it is corrupt.
+ */
+int indexopen(struct index *ix, int dir_fd, const char *name)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        die("fstat(%s)", name);
+    if (st.st_size < (off_t) sizeof(struct indexheader)) {
+        warnx("Index %s is truncated", name);
+        close(fd);
+        return -1;
+    }
+
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+        die("mmap(%s)", name);
+    close(fd);
+
+    ix->header = (const struct indexheader *) p;
+    ix->entries = (const struct indexentry *) (ix->header + 1);
+    ix->len = st.st_size;
+    if (memcmp(ix->header->magic, INDEX_MAGIC, 8) || ix->header->version != INDEX_VERSION) {
+        warnx("%s is not an index", name);
+        indexclose(ix);
+        return -1;
+    }
+
+    // Nothing in the file is trusted: the entries must fit, and every path
+    // must start within the table of paths, which must end with a NUL
+    size_t room = (ix->len - sizeof(struct indexheader)) / sizeof(struct indexentry);
+    bool valid = ix->header->count <= room;
+    if (valid) {
+        ix->paths = (const char *) (ix->entries + ix->header->count);
+        size_t npaths = (const char *) p + ix->len - ix->paths;
+        valid = !ix->header->count || (npaths && !ix->paths[npaths - 1]);
+        for (uint64_t i = 0; valid && i < ix->header->count; i++)
+            valid = ix->entries[i].path < npaths;
+    }
+    if (!valid) {
+        warnx("Index %s is corrupt", name);
+        indexclose(ix);
+        return -1;
+    }
+    return 0;
+}
+
+const char *indexpath(const struct index *ix, const struct indexentry *e)
+{
+    return ix->paths + e->path;
+}
+
+// Find the entry for path (in the form indexadd() stores it) by binary search
+const struct indexentry *indexfind(const struct index *ix, const char *path)
+{
+    size_t lo = 0, hi = ix->header->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int ret = strcmp(path, indexpath(ix, &ix->entries[mid]));
+        if (!ret)
+            return &ix->entries[mid];
+        if (ret < 0)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return NULL;
+}
+
+void indexclose(struct index *ix)
+{
+    munmap((void *) ix->header, ix->len);
+    memset(ix, 0, sizeof(struct index));
+}
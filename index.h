@@ -0,0 +1,60 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "untar.h"
+
+#define INDEX_VERSION 1
+#define INDEX_HASHLEN 32
+
+// Flags of an index
+#define INDEX_HASH 1
+#define INDEX_FILTERED 2
+
+/**
+ * Header of an index file. It is followed by <count> entries sorted on their
+ * paths, and a table with the paths themselves, such that an index can be
+ * mapped into memory and searched without parsing it.
+ */
+struct indexheader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint64_t count;
+    uint64_t bytes;
+};
+
+struct indexentry {
+    uint64_t size;
+    uint32_t path;
+    uint32_t mode;
+    unsigned char hash[INDEX_HASHLEN];
+    char type;
+    char pad[7];
+};
+
+// A mapped index
+struct index {
+    const struct indexheader *header;
+    const struct indexentry *entries;
+    const char *paths;
+    size_t len;
+};
+
+struct indexbuilder;
+
+struct indexbuilder *indexnew();
+size_t indexadd(struct indexbuilder *b, const struct tarfile *file);
+void indexhash(struct indexbuilder *b, size_t i, const unsigned char *hash);
+void indexwrite(struct indexbuilder *b, int dir_fd, const char *name, unsigned flags, bool durable);
+void indexfree(struct indexbuilder *b);
+
+int indexopen(struct index *ix, int dir_fd, const char *name);
+const struct indexentry *indexfind(const struct index *ix, const char *path);
+const char *indexpath(const struct index *ix, const struct indexentry *e);
+void indexclose(struct index *ix);
+
+#endif
\ No newline at end of file
@@ -4,12 +4,15 @@
 #include <linux/limits.h>
 #include <linux/sched.h>
 #include <poll.h>
+#include <spawn.h>
+#include <stdbool.h>
 #include <pty.h>
 #include <pwd.h>
 #include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
@@ -24,46 +27,121 @@
 #include "poddos.h"
 #include "net.h"
 #include "dhcp.h"
+#include "trace.h"
+#include "log.h"
+#include "cgroup.h"
+
+// Size of the buffers of the relay
+#define RELAY_BUFSIZE 65536
+
+// Milliseconds to wait for the remaining output of a container that exited
+#define RELAY_DRAIN 100
+
+// Size of the pipes of the output of the container, if it is logged
+#define RELAY_PIPESIZE (1024 * 1024)
 
 int namefd = -1, timefd = -1;
 
-void makeugmap(pid_t pid)
+/**
+ * The range of subordinate ids of the user in /etc/subuid or /etc/subgid.
+ * The files are parsed once per process, as prune --all maps ids for every
+ * layer it removes.
+ */
+struct subid {
+    bool parsed;
+    bool found;
+    unsigned long start, count;
+};
+
+static struct subid subuid, subgid;
+
+static void parsesubid(const char *path, struct subid *s)
 {
+    if (s->parsed)
+        return;
+    s->parsed = true;
+
     uid_t uid = geteuid();
-    gid_t gid = getegid();
     struct passwd *pwd = getpwuid(uid);
-    FILE *f;
+    FILE *f = fopen(path, "re");
+    if (!f)
+        return;
 
     char user[33] = { 0 };
-    int subid, subidcount;
-
-    int retuid = -1;
-    f = fopen("/etc/subuid", "r");
-    while (fscanf(f, " %32[^:]:%d:%d", user, &subid, &subidcount) == 3) {
-        if (!strcmp(user, pwd->pw_name) || atoi(user) == uid) {
-            char cmd[1024];
-            snprintf(cmd, 1024, "newuidmap %d 0 %d 1 1 %d %d", pid, uid, subid, subidcount);
-            retuid = system(cmd);
-            if (retuid == -1)
-                die("system(%s)", cmd);
+    unsigned long start, count;
+    while (fscanf(f, " %32[^:]:%lu:%lu", user, &start, &count) == 3) {
+        char *end;
+        unsigned long id = strtoul(user, &end, 10);
+        if ((pwd && !strcmp(user, pwd->pw_name)) || (!*end && id == uid)) {
+            s->found = true;
+            s->start = start;
+            s->count = count;
+            break;
         }
     }
     fclose(f);
+}
 
-    int retgid = -1;
-    f = fopen("/etc/subgid", "r");
-    while (fscanf(f, " %32[^:]:%d:%d", user, &subid, &subidcount) == 3) {
-        if (!strcmp(user, pwd->pw_name) || atoi(user) == uid) {
-            char cmd[1024];
-            snprintf(cmd, 1024, "newgidmap %d 0 %d 1 1 %d %d", pid, gid, subid, subidcount);
-            retgid = system(cmd);
-            if (retgid == -1)
-                die("system(%s)", cmd);
-        }
+/**
+ * Start helper (newuidmap or newgidmap) to map root in the namespace of pid
+ * to id and the subordinate ids to 1 and up. The helper is executed directly
+ * instead of via a shell. Returns the pid of the helper, or -1 if it could
+ * not be started.
+ */
+static pid_t spawnmap(const char *helper, pid_t pid, unsigned long id, const struct subid *s)
+{
+    if (!s->found)
+        return -1;
+
+    char args[4][24];
+    snprintf(args[0], 24, "%d", pid);
+    snprintf(args[1], 24, "%lu", id);
+    snprintf(args[2], 24, "%lu", s->start);
+    snprintf(args[3], 24, "%lu", s->count);
+    char *argv[] = { (char *) helper, args[0], "0", args[1], "1", "1", args[2], args[3], NULL };
+
+    pid_t child;
+    errno = posix_spawnp(&child, helper, NULL, NULL, argv, environ);
+    if (errno) {
+        // Not installed; the fallback in makeugmap() maps the user only
+        if (errno != ENOENT)
+            warn("Could not run %s", helper);
+        return -1;
     }
-    fclose(f);
+    return child;
+}
+
+// Wait for a helper started by spawnmap(), and return whether it succeeded
+static bool waitmap(pid_t child)
+{
+    if (child == -1)
+        return false;
+    int wstatus;
+    if (waitpid(child, &wstatus, 0) == -1)
+        die("waitpid");
+    return WIFEXITED(wstatus) && WEXITSTATUS(wstatus) == 0;
+}
+
+// Parse the subordinate ids ahead, such that forks of this process share them
+void loadsubids()
+{
+    parsesubid("/etc/subuid", &subuid);
+    parsesubid("/etc/subgid", &subgid);
+}
+
+void makeugmap(pid_t pid)
+{
+    uid_t uid = geteuid();
+    gid_t gid = getegid();
 
-    if (retuid != 0) {
+    // Both helpers run at the same time
+    loadsubids();
+    pid_t uidhelper = spawnmap("newuidmap", pid, uid, &subuid);
+    pid_t gidhelper = spawnmap("newgidmap", pid, gid, &subgid);
+    bool uidmapped = waitmap(uidhelper);
+    bool gidmapped = waitmap(gidhelper);
+
+    if (!uidmapped) {
         char buf[4096];
         snprintf(buf, 4096, "/proc/%d/uid_map", pid);
         int fd = open(buf, O_WRONLY);
@@ -77,7 +155,7 @@ void makeugmap(pid_t pid)
         close(fd);
     }
 
-    if (retgid != 0) {
+    if (!gidmapped) {
         char buf[4096];
 
         if (uid != 0) {
@@ -103,13 +181,186 @@ void makeugmap(pid_t pid)
     }
 }
 
-void forktochild()
+// Open the directory with the pids of named containers
+static void opennamedir()
+{
+    char namedir[PATH_MAX];
+    char *tmpdir = getenv("XDG_RUNTIME_DIR") ? getenv("XDG_RUNTIME_DIR") : "/tmp";
+    snprintf(namedir, PATH_MAX - 1, "%s/poddos", tmpdir);
+    if (mkdir(namedir, 0777) == -1 && errno != EEXIST)
+        die("mkdir(%s)", namedir);
+    namefd = open(namedir, O_DIRECTORY | O_CLOEXEC);
+    if (namefd == -1)
+        die("open(%s)", namedir);
+}
+
+/**
+ * Lock the directory with the pids, such that the zygotes of a container do
+ * not mix up its pid file. The lock is on an open file of its own, as namefd
+ * is shared with forked processes. Returns that file, to close when done.
+ */
+static int lockpids()
+{
+    int fd = openat(namefd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        die("open(.)");
+    if (flock(fd, LOCK_EX) == -1)
+        die("flock(.)");
+    return fd;
+}
+
+// Record the pid of a named container, for exec
+void writepid(pid_t pid)
+{
+    if (namefd > 0) {
+        int lock = lockpids();
+        int fdpid = openat(namefd, name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fdpid == -1)
+            die("open(%s)", name);
+        FILE *f = fdopen(fdpid, "w");
+        fprintf(f, "%d\n", pid);
+        fclose(f);
+        close(lock);
+    }
+}
+
+/**
+ * Remove the pid file of the container pid, unless it records another
+ * container of the same name by now, as when several zygotes run theirs.
+ */
+void removepid(pid_t pid)
+{
+    if (namefd > 0) {
+        int lock = lockpids();
+        int fdpid = openat(namefd, name, O_RDONLY | O_CLOEXEC);
+        if (fdpid != -1) {
+            FILE *f = fdopen(fdpid, "r");
+            pid_t recorded;
+            if (fscanf(f, "%d", &recorded) == 1 && recorded == pid)
+                unlinkat(namefd, name, 0);
+            fclose(f);
+        }
+        close(lock);
+    }
+}
+
+/**
+ * A direction of the relay of forktochild(), with from and to the indices of
+ * its ends in the poll set. Data is moved with splice(2) without copying it,
+ * unless copy is set (because neither end is a pipe, or the output does not
+ * support splice), in which case it goes through buf. Output that is logged
+ * goes to the log as the stream log (STDOUT_FILENO or STDERR_FILENO) instead.
+ */
+struct stream {
+    int from, to;
+    char *buf;
+    bool copy;
+    size_t off, pending;
+    int log;
+};
+
+// Read into the buffer of s, and return false at the end of the input
+static bool streamread(struct stream *s, int fd)
+{
+    ssize_t n = read(fd, s->buf, RELAY_BUFSIZE);
+    if (n == -1) {
+        // A pseudo tty of which the other side is closed gives EIO
+        if (errno == EIO)
+            return false;
+        if (errno != EAGAIN)
+            die("read");
+        n = 0;
+    } else if (n == 0)
+        return false;
+    s->off = 0;
+    s->pending = n;
+    return true;
+}
+
+// Read into the log, and return false at the end of the input
+static bool streamlog(struct stream *s, int fd)
+{
+    size_t room;
+    char *buf = logbuf(&room);
+    ssize_t n = read(fd, buf, room);
+    if (n == -1) {
+        if (errno != EAGAIN)
+            die("read");
+        return true;
+    }
+    logcommit(s->log, n);
+    return n != 0;
+}
+
+// Write what s has pending, and return false at the end of the input
+static bool streamwrite(struct stream *s, int from, int to)
+{
+    if (s->copy) {
+        ssize_t n = write(to, s->buf + s->off, s->pending);
+        if (n == -1 && errno == EAGAIN)
+            return true;
+        if (n == -1)
+            die("write");
+        s->off += n;
+        s->pending -= n;
+        return true;
+    }
+
+    s->pending = 0;
+    ssize_t n = splice(from, NULL, to, NULL, RELAY_BUFSIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == -1 && errno == EINVAL) {
+        // The output does not support splice (e.g., a file opened with O_APPEND)
+        s->copy = true;
+        return true;
+    }
+    if (n == -1 && errno != EAGAIN)
+        die("splice");
+    return n != 0;
+}
+
+// Close the output of s at the end of its input, and stop watching both
+static void streamclose(struct stream *s, struct pollfd *pfds)
+{
+    close(pfds[s->to].fd);
+    pfds[s->from].fd = -1;
+    pfds[s->to].fd = -1;
+    s->pending = 0;
+}
+
+// Exit in the same way as a process with status wstatus did
+void exitas(int wstatus)
+{
+    if (WIFEXITED(wstatus))
+        exit(WEXITSTATUS(wstatus));
+    else {
+        // Prepare a mask with the exit signal
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, WTERMSIG(wstatus));
+
+        // Ensure this process also exits when this signal is delivered
+        signal(WTERMSIG(wstatus), SIG_DFL);
+
+        // Unblock and raise the signal
+        if (sigprocmask(SIG_UNBLOCK, &mask, NULL) == -1)
+            die("sigprocmask");
+        raise(WTERMSIG(wstatus));
+    }
+}
+
+void forktochild(unsigned flags)
 {
     struct termios termp;
     int infd = -1, outfd = -1, errfd = -1;
-    const int istty = isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
+    const bool passthrough = flags & LAYER_PASSTHROUGH;
+    const bool logging = flags & LAYER_LOG;
+    const int istty = !passthrough && !logging && isatty(STDIN_FILENO) && isatty(STDOUT_FILENO);
     pid_t pid;
-    if (istty) {
+    if (passthrough) {
+        // The child keeps our stdin, stdout and stderr, so there is nothing
+        // to relay
+        pid = fork();
+    } else if (istty) {
         struct winsize ws;
         if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == -1)
             die("ioctl(TIOCGWINSZ)");
@@ -144,14 +395,7 @@ void forktochild()
     if (pid == -1)
         die("fork");
     if (pid > 0) {
-        if (namefd > 0) {
-            int fdpid = openat(namefd, name, O_WRONLY | O_CREAT, 0644);
-            if (fdpid == -1)
-                die("open(%s)", name);
-            FILE *f = fdopen(fdpid, "w");
-            fprintf(f, "%d\n", pid);
-            fclose(f);
-        }
+        writepid(pid);
 
         if (istty) {
             struct termios termp_raw = { 0 };
@@ -176,94 +420,87 @@ void forktochild()
             {.fd = infd,.events = 0 },
             {.fd = outfd,.events = 0 },
             {.fd = errfd,.events = 0 },
-            {.fd = STDIN_FILENO,.events = 0 },
-            {.fd = STDOUT_FILENO,.events = 0 },
-            {.fd = STDERR_FILENO,.events = 0 },
+            {.fd = passthrough ? -1 : STDIN_FILENO,.events = 0 },
+            {.fd = passthrough || logging ? -1 : STDOUT_FILENO,.events = 0 },
+            {.fd = passthrough || logging ? -1 : STDERR_FILENO,.events = 0 },
             {.fd = -1,.events = POLLIN },
             {.fd = sfd,.events = POLLIN },
             {.fd = timefd,.events = POLLIN },
         };
 
-        char bufin[1024], bufout[1024], buferr[1024];
-        int nin = 0, nout = 0, nerr = 0;
+        // The container may wait for its output to be read before it reads
+        // its input, so a write to its input must not block
+        if (!passthrough && fcntl(infd, F_SETFL, fcntl(infd, F_GETFL) | O_NONBLOCK) == -1)
+            die("fcntl");
+
+        // Let the container write ahead while the log is written or rotated
+        if (logging) {
+            fcntl(outfd, F_SETPIPE_SZ, RELAY_PIPESIZE);
+            fcntl(errfd, F_SETPIPE_SZ, RELAY_PIPESIZE);
+        }
+
+        // The output of the container is spliced without a pseudo tty, and
+        // copied otherwise (or if our output does not support splice)
+        static char bufin[RELAY_BUFSIZE], bufout[RELAY_BUFSIZE], buferr[RELAY_BUFSIZE];
+        struct stream streams[] = {
+            {.from = 3,.to = 0,.buf = bufin,.copy = true },
+            {.from = 1,.to = 4,.buf = bufout,.copy = istty,.log = logging ? STDOUT_FILENO : 0 },
+            {.from = 2,.to = 5,.buf = buferr,.copy = istty,.log = logging ? STDERR_FILENO : 0 },
+        };
         int goout = 0;
+        bool exited = false;
         for (;;) {
-            pfds[0].events = nin ? POLLOUT : 0;
-            pfds[1].events = !nout ? POLLIN : 0;
-            pfds[2].events = !nerr ? POLLIN : 0;
-            pfds[3].events = !nin ? POLLIN : 0;
-            pfds[4].events = nout ? POLLOUT : 0;
-            pfds[5].events = nerr ? POLLOUT : 0;
-
-            if (poll(pfds, nfds, -1) == -1) {
+            // After the child exited, only its remaining output is relayed
+            if (exited && pfds[1].fd == -1 && pfds[2].fd == -1)
+                break;
+            for (int i = 0; i < 3; i++) {
+                struct stream *s = &streams[i];
+                pfds[s->from].events = s->pending ? 0 : POLLIN;
+                pfds[s->to].events = s->pending ? POLLOUT : 0;
+            }
+
+            // The log is written when it is due (logtimeout() is -1 if it
+            // has nothing to write, or if there is no log)
+            int ret = poll(pfds, nfds, exited ? RELAY_DRAIN : logtimeout());
+            if (ret == -1) {
                 if (errno == EINTR)
                     continue;
                 die("poll");
             }
-            if (pfds[0].revents & POLLOUT) {
-                // stdin of the process is writable, and we have stuff to write
-                ssize_t n;
-                if ((n = write(infd, bufin, nin)) == -1)
-                    die("write(infd)");
-                memmove(bufin, bufin + n, nin - n);
-                nin -= n;
-            }
-            if (pfds[1].revents & POLLIN) {
-                // stdout of process contains data, and we have an empty buffer
-                if ((nout = read(outfd, bufout, 1024)) == -1)
-                    die("read(outfd)");
-            }
-            if (pfds[2].revents & POLLIN) {
-                // stderr of process contains data, and we have an empty buffer
-                if ((nerr = read(errfd, buferr, 1024)) == -1)
-                    die("read(errfd)");
-            }
-            if (pfds[3].revents & POLLIN) {
-                // Our stdin has data
-                if ((nin = read(STDIN_FILENO, bufin, 1024)) == -1)
-                    die("read(stdin)");
-
-                if (!nin) {
-                    // stdin is end of file, so closed
-                    close(infd);
-                    pfds[0].fd = -1;
-                    pfds[3].fd = -1;
+            if (ret == 0 && exited)
+                break;
+            if (logging && !logtimeout())
+                logflush();
+
+            for (int i = 0; i < 3; i++) {
+                struct stream *s = &streams[i];
+                if (!s->pending && pfds[s->from].fd != -1 && (pfds[s->from].revents & (POLLIN | POLLHUP | POLLERR))) {
+                    // Data is available, or the end of file (which read and
+                    // splice return once the data is consumed). POLLHUP is
+                    // also reported while we still have data to write.
+                    if (s->log) {
+                        if (!streamlog(s, pfds[s->from].fd))
+                            streamclose(s, pfds);
+                    } else if (!s->copy)
+                        s->pending = 1;
+                    else if (!streamread(s, pfds[s->from].fd))
+                        streamclose(s, pfds);
+                    else if (i == 0) {
+                        // ^] is the group seperator in ASCII, hex 0x1D. If it
+                        // is pressed three times consecutively, we go out
+                        // immediately.
+                        for (size_t j = 0; j < s->pending; j++)
+                            goout = (bufin[j] == 0x1D ? goout + 1 : 0);
+                        if (goout >= 3)
+                            kill(pid, SIGKILL);
+                    }
+                }
+                if (pfds[s->to].fd != -1 && (pfds[s->to].revents & POLLOUT)) {
+                    if (!streamwrite(s, pfds[s->from].fd, pfds[s->to].fd))
+                        streamclose(s, pfds);
                 }
-                // ^] is the group seperator in ASCII, hex 0x1D. If it is
-                // pressed three times consecutively, we go out immediately.
-                for (int i = 0; i < nin; i++)
-                    goout = (bufin[i] == 0x1D ? goout + 1 : 0);
-                if (goout >= 3)
-                    kill(pid, SIGKILL);
-            }
-            if (pfds[4].revents & POLLOUT) {
-                // Our stdout is writable, and we have stuff to write
-                ssize_t n;
-                if ((n = write(STDOUT_FILENO, bufout, nout)) == -1)
-                    die("write(stdout)");
-                memmove(bufout, bufout + n, nout - n);
-                nout -= n;
-            }
-            if (pfds[5].revents & POLLOUT) {
-                // Our stderr is writable, and we have stuff to write
-                ssize_t n;
-                if ((n = write(STDERR_FILENO, buferr, nerr)) == -1)
-                    die("write(stderr)");
-                memmove(buferr, buferr + n, nerr - n);
-                nerr -= n;
-            }
-            if (pfds[1].revents & POLLHUP) {
-                // stdout of process hang up, close stdout and stop watching
-                pfds[1].fd = -1;
-                pfds[4].fd = -1;
-                close(STDOUT_FILENO);
-            }
-            if (pfds[2].revents & POLLHUP) {
-                // stderr of process hung up, close stderr and stop watching
-                pfds[2].fd = -1;
-                pfds[5].fd = -1;
-                close(STDERR_FILENO);
             }
+
             if (pfds[6].revents & POLLIN) {
                 // The socket used for DHCP got data
                 pfds[6].fd = dhcpstep(macvlan, pfds[6].fd);
@@ -293,8 +530,14 @@ void forktochild()
                     if (ioctl(infd, TIOCSWINSZ, &ws) == -1)
                         die("ioctl(TIOCSWINSZ)");
                 } else if (fdsi.ssi_signo == SIGCHLD) {
-                    // SIGCHLD indicates that the child exited
-                    break;
+                    // SIGCHLD indicates that the child exited, but its output
+                    // may not have been relayed yet
+                    exited = true;
+                    pfds[0].fd = -1;
+                    pfds[3].fd = -1;
+                    pfds[6].fd = -1;
+                    pfds[7].fd = -1;
+                    pfds[8].fd = -1;
                 } else {
                     // Send the signal to the child
                     kill(pid, fdsi.ssi_signo);
@@ -318,6 +561,8 @@ void forktochild()
 
         close(sfd);
         close(timefd);
+        if (logging)
+            logclose();
 
         int wstatus;
         if (wait(&wstatus) == -1)
@@ -331,75 +576,85 @@ void forktochild()
 
         if (istty)
             tcsetattr(STDIN_FILENO, TCSADRAIN, &termp);
-        if (namefd > 0)
-            unlinkat(namefd, name, 0);
-
-        if (WIFEXITED(wstatus))
-            exit(WEXITSTATUS(wstatus));
-        else {
-            // Prepare a mask with the exit signal
-            sigset_t mask;
-            sigemptyset(&mask);
-            sigaddset(&mask, WTERMSIG(wstatus));
-
-            // Ensure this process also exits when this signal is delivered
-            signal(WTERMSIG(wstatus), SIG_DFL);
-
-            // Unblock and raise the signal
-            if (sigprocmask(SIG_UNBLOCK, &mask, NULL) == -1)
-                die("sigprocmask");
-            raise(WTERMSIG(wstatus));
-        }
+        removepid(pid);
+
+        exitas(wstatus);
     }
 }
 
-void lstart(unsigned flags, char **argv, char **envp)
+/**
+ * Set the directory parameter key of an overlayfs under construction. The
+ * directory is passed as a file descriptor if the kernel supports that (since
+ * Linux 6.13), and by path otherwise.
+ */
+static bool ovlconfig(int fsfd, const char *key, const char *path)
 {
-    int pipefd[2];
-    if (pipe2(pipefd, O_CLOEXEC) == -1)
-        die("pipe");
-
-    pid_t pid = fork();
-    if (pid == 0) {
-        // Child: close write end
-        close(pipefd[1]);
+    int fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        die("open(%s)", path);
+    int ret = fsconfig(fsfd, FSCONFIG_SET_FD, key, NULL, fd);
+    close(fd);
+    if (ret == -1)
+        ret = fsconfig(fsfd, FSCONFIG_SET_STRING, key, path, 0);
+    return ret == 0;
+}
 
-        // The read call unblocks when parent has unshared or crashed
-        char buf;
-        if (read(pipefd[0], &buf, 1) > -1) {
-            makeugmap(getppid());
-            if (flags & LAYER_NET)
-                makemacvlan(getppid());
+/**
+ * Mount the overlayfs of the lower directories, upperdir and workdir on
+ * mergeddir. With the new mount API, every lower directory is a parameter of
+ * its own (lowerdir+, since Linux 6.8), such that the number of layers is not
+ * bounded by the size of the mount options. Older kernels get the mount
+ * options of mount(2), which are limited to a page.
+ */
+static void mountoverlay(const char *mergeddir, const char *workdir)
+{
+    int fsfd = fsopen("overlay", FSOPEN_CLOEXEC);
+    if (fsfd > -1) {
+        bool ok = true;
+        for (int i = nlowerdir - 1; ok && i >= 0; i--)
+            ok = ovlconfig(fsfd, "lowerdir+", lowerdirs[i]);
+        ok = ok && ovlconfig(fsfd, "upperdir", upperdir) && ovlconfig(fsfd, "workdir", workdir)
+            && fsconfig(fsfd, FSCONFIG_SET_STRING, "xino", "off", 0) == 0
+            && fsconfig(fsfd, FSCONFIG_SET_FLAG, "userxattr", NULL, 0) == 0;
+        if (ok) {
+            if (fsconfig(fsfd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) == -1)
+                die("fsconfig(%s, FSCONFIG_CMD_CREATE)", mergeddir);
+            int mfd = fsmount(fsfd, FSMOUNT_CLOEXEC, 0);
+            if (mfd == -1)
+                die("fsmount(%s)", mergeddir);
+            if (move_mount(mfd, "", AT_FDCWD, mergeddir, MOVE_MOUNT_F_EMPTY_PATH) == -1)
+                die("move_mount(%s)", mergeddir);
+            close(mfd);
+            close(fsfd);
+            return;
         }
-
-        quick_exit(0);
+        close(fsfd);
     }
 
-    if (name) {
-        char namedir[PATH_MAX];
-        char *tmpdir = getenv("XDG_RUNTIME_DIR") ? getenv("XDG_RUNTIME_DIR") : "/tmp";
-        snprintf(namedir, PATH_MAX - 1, "%s/poddos", tmpdir);
-        if (mkdir(namedir, 0777) == -1 && errno != EEXIST)
-            die("mkdir(%s)", namedir);
-        namefd = open(namedir, O_DIRECTORY | O_CLOEXEC);
-        if (namefd == -1)
-            die("open(%s)", namedir);
+    size_t len = strlen("lowerdir=,upperdir=,workdir=,xino=off,userxattr") + strlen(upperdir) + strlen(workdir) + 1;
+    for (int i = 0; i < nlowerdir; i++)
+        len += strlen(lowerdirs[i]) + 1;
+    char *data = malloc(len);
+    if (!data)
+        die("malloc");
+
+    char *p = stpcpy(data, "lowerdir=");
+    for (int i = nlowerdir - 1; i >= 0; i--) {
+        p = stpcpy(p, lowerdirs[i]);
+        if (i)
+            *p++ = ':';
     }
+    sprintf(p, ",upperdir=%s,workdir=%s,xino=off,userxattr", upperdir, workdir);
 
-    unsigned uflags = CLONE_NEWNS | CLONE_NEWCGROUP | CLONE_NEWIPC | CLONE_NEWUSER | CLONE_NEWPID;
-    if (flags & LAYER_NET)
-        uflags |= CLONE_NEWNET | CLONE_NEWUTS;
-    if (unshare(uflags) == -1)
-        die("unshare");
-
-    close(pipefd[0]);
-    close(pipefd[1]);
+    if (mount("none", mergeddir, "overlay", 0, data) == -1)
+        die("mount(%s, %s)", mergeddir, data);
+    free(data);
+}
 
-    int wstatus;
-    if (wait(&wstatus) == -1)
-        die("wait");
-    if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus))
-        diex("Child crashed (exit status %d).", WEXITSTATUS(wstatus));
+// Build the root file system of a container in its (new) mount namespace
+static void lrootfs(unsigned flags)
+{
+    tracephase("overlay");
 
     // Ensure mount events remain in this namespace. This should already happen
     // by default actually.
@@ -417,17 +672,8 @@ void lstart(unsigned flags, char **argv, char **envp)
             diex("Ephemeral path too long.");
         if (mount("none", ephemeral, "tmpfs", 0, "mode=777") == -1)
             die("mount(%s)", ephemeral);
-        if (upperdir[0] && dircnt(upperdir) > 2) {
-            if (!lowerdir[0])
-                strcpy(lowerdir, upperdir);
-            else {
-                char buf[4096];
-                int ret = snprintf(buf, 4096, "%s:%s", upperdir, lowerdir);
-                if (ret > 4096)
-                    diex("Overlayfs paths too long");
-                strcpy(lowerdir, buf);
-            }
-        }
+        if (upperdir[0] && dircnt(upperdir) > 2)
+            addlowerdir(upperdir);
         ret = snprintf(upperdir, PATH_MAX, "%s/upper", ephemeral);
         if (ret > PATH_MAX)
             diex("Upper directory too long.");
@@ -436,7 +682,7 @@ void lstart(unsigned flags, char **argv, char **envp)
     }
     // Build up the overlayfs; unless there is no lowerdir, since then there is no real overlay
     char mergeddir[PATH_MAX];
-    if (lowerdir[0]) {
+    if (nlowerdir) {
         char workdir[PATH_MAX];
         int ret = snprintf(workdir, PATH_MAX, "%s:work", upperdir);
         if (ret > PATH_MAX)
@@ -449,13 +695,7 @@ void lstart(unsigned flags, char **argv, char **envp)
         if (mkdir(mergeddir, 0777) == -1 && errno != EEXIST)
             die("mkdir(%s)", mergeddir);
 
-        char data[4096];
-        ret = snprintf(data, 4096, "lowerdir=%s,upperdir=%s,workdir=%s,xino=off,userxattr", lowerdir, upperdir, workdir);
-        if (ret > 4096)
-            diex("Configuration of overlayfs filesystem too long.");
-
-        if (mount("none", mergeddir, "overlay", 0, data) == -1)
-            die("mount(%s, %s)", mergeddir, data);
+        mountoverlay(mergeddir, workdir);
     } else {
         int ret = snprintf(mergeddir, PATH_MAX, "%s:merged", upperdir);
         if (ret > PATH_MAX)
@@ -466,6 +706,8 @@ void lstart(unsigned flags, char **argv, char **envp)
             die("mount(%s, %s, MS_BIND)", upperdir, mergeddir);
     }
 
+    tracephase("etc");
+
     // Configure networking: without separate networking, the configuration
     // files are simply bind mounted. Otherwise, /etc/hostname is populated by
     // the container name, /etc/resolv.conf is populated by dhcp, and
@@ -530,6 +772,8 @@ void lstart(unsigned flags, char **argv, char **envp)
         bringloup();
     }
 
+    tracephase("pivot_root");
+
     // Pivot root, or in other words, change the root directory to the merged directory
     char oldroot[PATH_MAX];
     int ret = snprintf(oldroot, PATH_MAX, "%s/old_root", mergeddir);
@@ -542,6 +786,8 @@ void lstart(unsigned flags, char **argv, char **envp)
     if (chdir("/") == -1)
         die("chdir(/)");
 
+    tracephase("dev");
+
     // Populate /dev with the usual things. The mode=755 ensure there is no
     // 'sticky' bit, which blocks writing to a device with -EACCES
     if (mount("none", "/dev", "tmpfs", MS_NOSUID, "mode=755") == -1)
@@ -602,12 +848,76 @@ void lstart(unsigned flags, char **argv, char **envp)
     // Make a timer file descriptor before forking
     if ((flags & LAYER_NET) && (timefd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK)) == -1)
         die("timefd_create");
+}
+
+/**
+ * Set up the namespaces and the root file system of a container, up to the
+ * point where pid 1 is forked.
+ */
+void lprepare(unsigned flags)
+{
+    // Enter the cgroup of the container before anything is forked, such
+    // that the unshared cgroup namespace is rooted at it
+    tracephase("cgroup");
+    int cgroup_fd = cgroupcreate(true);
+    if (cgroup_fd != -1)
+        close(cgroup_fd);
+
+    tracephase("helper");
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1)
+        die("pipe");
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Child: close write end
+        close(pipefd[1]);
+
+        // The read call unblocks when parent has unshared or crashed
+        char buf;
+        if (read(pipefd[0], &buf, 1) > -1) {
+            makeugmap(getppid());
+            if (flags & LAYER_NET)
+                makemacvlan(getppid());
+        }
+
+        quick_exit(0);
+    }
+
+    if (name)
+        opennamedir();
+
+    unsigned uflags = CLONE_NEWNS | CLONE_NEWCGROUP | CLONE_NEWIPC | CLONE_NEWUSER | CLONE_NEWPID;
+    if (flags & LAYER_NET)
+        uflags |= CLONE_NEWNET | CLONE_NEWUTS;
+    tracephase("unshare");
+    if (unshare(uflags) == -1)
+        die("unshare");
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    tracephase("uidmap");
+    int wstatus;
+    if (wait(&wstatus) == -1)
+        die("wait");
+    if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus))
+        diex("Child crashed (exit status %d).", WEXITSTATUS(wstatus));
+
+    lrootfs(flags);
+}
+
+void lstart(unsigned flags, char **argv, char **envp)
+{
+    lprepare(flags);
 
     // Fork to get pid 1, this will also get us a pty if needed
-    forktochild();
+    tracephase("forktochild");
+    forktochild(flags);
 
     // Initialize DHCP
     if (flags & LAYER_NET) {
+        tracephase("dhcp");
         int sock = dhcpstart(macvlan);
         while (sock > 0)
             sock = dhcpstep(macvlan, sock);
@@ -620,7 +930,15 @@ void lstart(unsigned flags, char **argv, char **envp)
 
         close(timefd);
     }
+
+    lfinish(argv, envp);
+}
+
+// Complete the container as pid 1 and execute the command
+void lfinish(char **argv, char **envp)
+{
     // Mount /proc (now that we are pid 1)
+    tracephase("proc/sys");
     if (mount("none", "/proc", "proc", MS_NODEV | MS_NOSUID | MS_NOEXEC, NULL) == -1)
         die("mount(/proc)");
 
@@ -634,6 +952,7 @@ void lstart(unsigned flags, char **argv, char **envp)
     }
 
     // Make the additional bind mounts that the user requested
+    tracephase("binds");
     for (int i = 0; i < nbind; i++) {
         char path_from[PATH_MAX], path_to[PATH_MAX];
         snprintf(path_from, PATH_MAX, "/old_root%s", bind_from[i]);
@@ -660,6 +979,7 @@ void lstart(unsigned flags, char **argv, char **envp)
             die("mount(%s)", path_to);
     }
 
+    tracephase("exec");
     if (umount2("/old_root", MNT_DETACH) == -1)
         die("umount2(/old_root, MNT_DETACH)");
     if (rmdir("/old_root") == -1)
@@ -674,10 +994,77 @@ void lstart(unsigned flags, char **argv, char **envp)
     for (int i = 0; envp[i]; i++)
         putenv(envp[i]);
 
+    traceflush();
     execvp(argv[0], argv);
     die("execv");
 }
 
+/**
+ * Start a container without a process in between: pid 1 is cloned straight
+ * into the new namespaces and sets up the container itself, with the standard
+ * input, output and error of the caller. Returns the pid of pid 1, which the
+ * caller reaps. Networking is not supported, as DHCP needs a process outside
+ * of the container.
+ */
+pid_t lspawn(unsigned flags, char **argv, char **envp)
+{
+    if (flags & LAYER_NET)
+        diex("Networking is not supported here");
+    if (name)
+        opennamedir();
+
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) == -1)
+        die("pipe");
+
+    struct clone_args cl_args = { 0 };
+    cl_args.flags = CLONE_NEWNS | CLONE_NEWCGROUP | CLONE_NEWIPC | CLONE_NEWUSER | CLONE_NEWPID;
+    cl_args.exit_signal = SIGCHLD;
+
+    // Start the container in its own cgroup right away, if it has one
+    int cgroup_fd = cgroupcreate(false);
+    if (cgroup_fd != -1) {
+        cl_args.flags |= CLONE_INTO_CGROUP;
+        cl_args.cgroup = cgroup_fd;
+    }
+
+    fflush(NULL);
+    pid_t pid = syscall(SYS_clone3, &cl_args, sizeof(struct clone_args));
+    if (pid == -1 && cgroup_fd != -1 && (errno == EINVAL || errno == E2BIG)) {
+        // Before Linux 5.7, the container is moved into its cgroup once it
+        // exists instead (its cgroup namespace is then that of the daemon)
+        cl_args.flags &= ~CLONE_INTO_CGROUP;
+        pid = syscall(SYS_clone3, &cl_args, sizeof(struct clone_args));
+    }
+    if (pid == -1)
+        die("clone3");
+    if (pid == 0) {
+        // Child, wait for the parent to setup the uid / gid map
+        close(pipefd[1]);
+        char buf;
+        if (read(pipefd[0], &buf, 1) == -1)
+            die("read(pipefd)");
+        close(pipefd[0]);
+
+        lrootfs(flags);
+        lfinish(argv, envp);
+    }
+    if (cgroup_fd != -1) {
+        if (!(cl_args.flags & CLONE_INTO_CGROUP))
+            cgroupenter(cgroup_fd, pid);
+        close(cgroup_fd);
+        cgroupwatch(pid);
+    }
+    makeugmap(pid);
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    writepid(pid);
+    if (namefd > 0)
+        close(namefd);
+    return pid;
+}
+
 void lexec(unsigned flags, char **argv, char **envp)
 {
     char namefile[PATH_MAX];
@@ -705,7 +1092,7 @@ void lexec(unsigned flags, char **argv, char **envp)
 
     close(pidfd);
 
-    forktochild();
+    forktochild(flags);
 
     // Set up the environment such that execvp works
     clearenv();
@@ -5,9 +5,18 @@
 
 #define LAYER_EPHEMERAL 1
 #define LAYER_NET 2
+#define LAYER_PASSTHROUGH 4
+#define LAYER_LOG 8
 
+void loadsubids();
 void makeugmap(pid_t pid);
+void exitas(int wstatus);
+void writepid(pid_t pid);
+void removepid(pid_t pid);
+void lprepare(unsigned flags);
+void lfinish(char **argv, char **envp);
 void lstart(unsigned flags, char **argv, char **envp);
+pid_t lspawn(unsigned flags, char **argv, char **envp);
 void lexec(unsigned flags, char **argv, char **envp);
 
 #endif
@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "poddos.h"
+
+// Size of the buffer in which the output is collected before it is written
+#define LOG_BUFSIZE (1024 * 1024)
+
+// Room that a read gets at least, the buffer is written out if it has less
+#define LOG_MINREAD 65536
+
+// Maximum number of pieces (output and prefixes) written by one writev
+#define LOG_IOVMAX 1024
+
+// Maximum length of the prefix of a line: a timestamp and a stream tag
+#define LOG_PREFIXLEN 40
+
+// Milliseconds that output may stay in the buffer
+#define LOG_FLUSH 1000
+
+/**
+ * The log file is kept as a directory and a name in it, as rotating it
+ * happens after pivot_root, when its path is not reachable anymore.
+ */
+static int dir_fd = -1, fd = -1;
+static char *base = NULL;
+static off_t size = 0, maxsize = 0;
+static int keep = 0;
+static unsigned flags = 0;
+
+/**
+ * Output is read into data, and written with a single writev of the pieces
+ * in iov. Without prefixes, consecutive reads form a single piece. With
+ * prefixes, every line gets a piece for its prefix (stored in the prefix with
+ * the same index) and one for its contents, so the output is never copied.
+ */
+static char data[LOG_BUFSIZE];
+static size_t ndata = 0;
+static struct iovec iov[LOG_IOVMAX];
+static char prefixes[LOG_IOVMAX][LOG_PREFIXLEN];
+static int niov = 0;
+
+// Whether the next output of stdout and stderr starts a line
+static bool atbol[3] = { true, true, true };
+
+// Time (in ms on CLOCK_MONOTONIC) at which the buffer is due to be written
+static long long deadline = 0;
+
+static long long msecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void reopen()
+{
+    fd = openat(dir_fd, base, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1)
+        die("open(%s)", base);
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        die("fstat(%s)", base);
+    size = st.st_size;
+}
+
+// Move FILE to FILE.1, FILE.1 to FILE.2 and so on, such that FILE.<keep> drops
+static void rotate()
+{
+    close(fd);
+    if (!keep && unlinkat(dir_fd, base, 0) == -1 && errno != ENOENT)
+        die("unlink(%s)", base);
+    for (int i = keep - 1; i >= 0; i--) {
+        char from[PATH_MAX], to[PATH_MAX];
+        if (i)
+            snprintf(from, PATH_MAX, "%s.%d", base, i);
+        else
+            snprintf(from, PATH_MAX, "%s", base);
+        snprintf(to, PATH_MAX, "%s.%d", base, i + 1);
+        if (renameat(dir_fd, from, dir_fd, to) == -1 && errno != ENOENT)
+            die("rename(%s, %s)", from, to);
+    }
+    reopen();
+}
+
+// Write the pieces, after rotating the file if it would grow beyond maxsize
+static void logwrite()
+{
+    size_t total = 0;
+    for (int i = 0; i < niov; i++)
+        total += iov[i].iov_len;
+    if (maxsize && size > 0 && size + total > maxsize)
+        rotate();
+
+    struct iovec *v = iov;
+    int left = niov;
+    while (left) {
+        ssize_t n = writev(fd, v, left);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            die("writev(%s)", base);
+        }
+        size += n;
+        while (left && (size_t) n >= v->iov_len) {
+            n -= v->iov_len;
+            v++;
+            left--;
+        }
+        if (left) {
+            v->iov_base = (char *) v->iov_base + n;
+            v->iov_len -= n;
+        }
+    }
+    niov = 0;
+}
+
+/**
+ * Log the output of the container to the file at path, which is rotated when
+ * it would grow beyond maxsize (if not 0), keeping keep old files. Flags are
+ * LOG_TIME to prefix lines with the time and LOG_STREAM to prefix them with
+ * the stream (stdout or stderr).
+ */
+void logopen(const char *path, off_t max, int nkeep, unsigned logflags)
+{
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+    base = strdup(slash ? slash + 1 : path);
+    if (!dir || !base)
+        die("strdup");
+    if (!base[0])
+        diex("Invalid log file: %s", path);
+
+    dir_fd = open(dir, O_DIRECTORY | O_PATH | O_CLOEXEC);
+    if (dir_fd == -1)
+        die("open(%s)", dir);
+    free(dir);
+
+    maxsize = max;
+    keep = nkeep;
+    flags = logflags;
+    reopen();
+}
+
+// Where to read output into, with room for at least LOG_MINREAD bytes
+char *logbuf(size_t *room)
+{
+    if (LOG_BUFSIZE - ndata < LOG_MINREAD)
+        logflush();
+    *room = LOG_BUFSIZE - ndata;
+    return data + ndata;
+}
+
+// Add n bytes that were read into logbuf() from stream (stdout or stderr)
+void logcommit(int stream, size_t n)
+{
+    if (!n)
+        return;
+    if (!deadline)
+        deadline = msecs() + LOG_FLUSH;
+
+    char prefix[LOG_PREFIXLEN] = "";
+    if (flags & LOG_TIME) {
+        struct timespec ts;
+        struct tm tm;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        gmtime_r(&ts.tv_sec, &tm);
+        size_t len = strftime(prefix, LOG_PREFIXLEN, "%Y-%m-%dT%H:%M:%S", &tm);
+        snprintf(prefix + len, LOG_PREFIXLEN - len, ".%06ldZ ", ts.tv_nsec / 1000);
+    }
+    if (flags & LOG_STREAM)
+        strcat(prefix, stream == STDERR_FILENO ? "stderr " : "stdout ");
+
+    char *p = data + ndata, *end = p + n;
+    ndata += n;
+    while (p < end) {
+        if (flags && atbol[stream]) {
+            if (niov == LOG_IOVMAX)
+                logwrite();
+            strcpy(prefixes[niov], prefix);
+            iov[niov].iov_base = prefixes[niov];
+            iov[niov].iov_len = strlen(prefix);
+            niov++;
+        }
+
+        char *nl = flags ? memchr(p, '\n', end - p) : NULL;
+        char *next = nl ? nl + 1 : end;
+        if (niov && (char *) iov[niov - 1].iov_base + iov[niov - 1].iov_len == p)
+            iov[niov - 1].iov_len += next - p;
+        else {
+            if (niov == LOG_IOVMAX)
+                logwrite();
+            iov[niov].iov_base = p;
+            iov[niov].iov_len = next - p;
+            niov++;
+        }
+        atbol[stream] = next[-1] == '\n';
+        p = next;
+    }
+}
+
+// Milliseconds until the buffer is due to be written, or -1 if it is empty
+int logtimeout()
+{
+    if (!deadline)
+        return -1;
+    long long left = deadline - msecs();
+    return left > 0 ? left : 0;
+}
+
+void logflush()
+{
+    logwrite();
+    ndata = 0;
+    deadline = 0;
+}
+
+void logclose()
+{
+    logflush();
+    close(fd);
+    close(dir_fd);
+    fd = dir_fd = -1;
+}
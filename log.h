@@ -0,0 +1,18 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Flags of a log
+#define LOG_TIME 1
+#define LOG_STREAM 2
+
+void logopen(const char *path, off_t maxsize, int keep, unsigned flags);
+char *logbuf(size_t *room);
+void logcommit(int stream, size_t n);
+int logtimeout();
+void logflush();
+void logclose();
+
+#endif
@@ -1,5 +1,6 @@
 #define _GNU_SOURCE
 #include <argp.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <err.h>
 #include <stdio.h>
@@ -11,9 +12,16 @@
 #include <sys/stat.h>
 
 #include "pull.h"
+#include "index.h"
 #include "layer.h"
 #include "prune.h"
+#include "flatten.h"
+#include "zygote.h"
+#include "daemon.h"
 #include "poddos.h"
+#include "trace.h"
+#include "log.h"
+#include "cgroup.h"
 
 static struct argp_option global_options[] = {
     {"layer", 'l', "PATH", 0, "Path where layers are stored. "
@@ -25,16 +33,45 @@ static struct argp_option global_options[] = {
 
 static struct argp_option pull_options[] = {
     {"url", 'u', "URL", 0, "Pull a series of layers from this url"},
+    {"dedup", 1005, NULL, 0, "Store identical files only once. "
+                             "Files in the pulled layers with the same contents, mode, owner and modification time as a file in any other layer pulled with this option become hardlinks to that file. "
+                             "Files that only have the same contents and mode share their data if the file system supports reflinks. "
+                             "The index of all contents is kept in the .content directory in the layer path."},
+    {"sync", 1007, NULL, 0, "Make sure every layer is on disk before it is marked as complete, using a single syncfs() per layer. "
+                            "Without this option, a crash shortly after a pull may leave layers that are marked as complete but have empty files."},
+    {"include", 1008, "GLOB", 0, "Only extract the files matching this pattern, to be specified multiple times if needed. "
+                                 "Patterns are matched against the path in the layer without a leading slash (e.g., usr/bin/*), and a pattern matching a directory matches everything in it. "
+                                 "Directories are always created. "
+                                 "Layers that are pulled with --include or --exclude are stored separately from the full layers."},
+    {"exclude", 1009, "GLOB", 0, "Do not extract the files matching this pattern (e.g., usr/share/doc), to be specified multiple times if needed. "
+                                 "Takes precedence over --include."},
+    {"quiet", 'q', NULL, 0, "Do not report progress."},
+    {"background", 1006, NULL, 0, "Pull with the lowest CPU and I/O priority, and write out extracted files right away instead of in bursts. "
+                                  "This keeps a pull from hurting the latency of running containers, at the cost of a slower pull. "
+                                  "To limit the bandwidth of a pull as well, run it in a cgroup with io.max and cpu.max set (e.g., via systemd-run)."},
+    {"verbose", 'v', NULL, 0, "List every file that is extracted, instead of reporting the progress of each layer a few times per second."},
     {0}
 };
 
 static struct argp_option prune_options[] = {
     {"all", 'a', NULL, 0, "Prune all layers found in the layer path that are not used by any configuration anymore. "
-                          "Asks before doing any removal."},
+                          "Asks before doing any removal. "
+                          "Snapshots made by flatten of which a layer changed, is gone, or is not used anymore are removed as well."},
     {"force", 'f', NULL, 0, "If used in combination with --all, do not confirm before removing a layer."},
     {0}
 };
 
+static struct argp_option flatten_options[] = {
+    {"overlay", 'o', "PATH", 0, "Overlay paths, as for start."},
+    {"force", 'f', NULL, 0, "Flatten again, even if a snapshot of these layers exists already."},
+    {0}
+};
+
+static struct argp_option which_options[] = {
+    {"overlay", 'o', "PATH", 0, "Overlay paths, as for start."},
+    {0}
+};
+
 static struct argp_option start_options[] = {
     {"overlay", 'o', "PATH", 0, "Overlay paths, to be specified multiple times. "
                                 "Each path is overlayed on top of the previous one. "
@@ -57,6 +94,44 @@ static struct argp_option start_options[] = {
                                  "All provided paths should be absolute paths."},
     {"directory", 'C', "PATH", 0, "Change to the specified directory before executing the specified command. "
                                   "The specified directory should be an existing directory in the folder structure of the container."},
+    {"trace", 1010, "FILE", 0, "Write the time spent in each phase of starting the container to <FILE>, in the Chrome trace event format (see chrome://tracing or ui.perfetto.dev). "
+                               "Defaults to the value of PODDOS_TRACE, if set."},
+    {"zygote", 1011, NULL, 0, "Hand the command to a zygote of this container (see poddos zygote), which has set up the container already. "
+                             "The command gets the standard input, output and error of poddos directly, without a pseudo tty. "
+                             "If there is no zygote, the container is started as usual. "
+                             "Not supported for containers started by poddos daemon."},
+    {"passthrough", 1013, NULL, 0, "Give the command the standard input, output and error of poddos, instead of relaying them via pipes or a pseudo tty. "
+                                   "poddos then only forwards signals and waits for the command to exit. "
+                                   "This saves a copy of all output, but the ^] escape does not work and the command gets no pseudo tty. "
+                                   "Useful when the output goes to a file or the journal anyway (e.g., in poddos@.service)."},
+    {"log", 1014, "FILE", 0, "Write the output of the command to <FILE> instead of to the output of poddos, without a pseudo tty. "
+                             "Output is collected in a large buffer and written at least once a second, and <FILE> is rotated when it grows too large (see --log-size). "
+                             "Cannot be combined with --passthrough or --zygote."},
+    {"log-size", 1015, "SIZE", 0, "Size in bytes (or with a suffix K, M or G) at which the log is rotated, 0 to never rotate it (default 10M)."},
+    {"log-keep", 1016, "N", 0, "Number of rotated logs to keep, as <FILE>.1 (the most recent) up to <FILE>.<N> (default 5)."},
+    {"log-time", 1017, NULL, 0, "Start every line in the log with the time (in UTC) at which it was read."},
+    {"log-stream", 1018, NULL, 0, "Start every line in the log with the stream it was written to (stdout or stderr)."},
+    {"cpu-max", 1019, "QUOTA [PERIOD]", 0, "Limit the container to <QUOTA> microseconds of CPU time per <PERIOD> (default 100000), as cpu.max of cgroup v2. "
+                                          "The options that limit resources put the container in a child cgroup of the cgroup of poddos, named after the container and removed when it exits. "
+                                          "poddos must be the only process in its cgroup and that cgroup must be delegated to the user, as is done by Delegate=yes in poddos@.service."},
+    {"cpu-weight", 1020, "WEIGHT", 0, "Relative share of CPU time of the container, from 1 to 10000 (default 100), as cpu.weight."},
+    {"memory-max", 1021, "BYTES", 0, "Hard limit on the memory of the container (with a suffix K, M or G), as memory.max."},
+    {"memory-high", 1022, "BYTES", 0, "Limit above which the memory of the container is reclaimed and it is throttled, as memory.high."},
+    {"io-max", 1023, "MAJ:MIN LIMITS", 0, "Limit the I/O of the container to a device (e.g., \"8:0 rbps=1048576 wiops=100\"), as io.max. "
+                                         "Specify multiple times for multiple devices."},
+    {"io-weight", 1024, "WEIGHT", 0, "Relative share of I/O of the container, from 1 to 10000 (default 100), as io.weight."},
+    {"pids-max", 1025, "N", 0, "Maximum number of processes and threads in the container, as pids.max."},
+    {"cpuset", 1026, "CPUS", 0, "Run the container only on these CPUs (e.g., 0-3,8), as cpuset.cpus."},
+    {0}
+};
+
+static struct argp_option daemon_options[] = {
+    {0}
+};
+
+static struct argp_option zygote_options[] = {
+    {"count", 1012, "N", 0, "Number of containers to keep ready (default 1)."},
+    {"ephemeral", 'E', NULL, 0, "As for start, required for more than one zygote."},
     {0}
 };
 
@@ -71,6 +146,12 @@ const char *url = NULL;
 
 bool ephemeral = false;
 
+bool dedup = false;
+bool background = false;
+bool durable = false;
+struct pullfilter filter = { 0 };
+unsigned verbosity = 0;
+
 bool prune_all = false;
 bool force = false;
 
@@ -81,7 +162,23 @@ char *dnsserver = NULL;
 
 char *name = NULL;
 
-char lowerdir[4096] = { 0 };
+char *tracefile = NULL;
+
+bool supervised = false;
+pid_t spawned = -1;
+
+bool usezygote = false;
+int nzygote = 1;
+
+bool passthrough = false;
+
+char *logfile = NULL;
+off_t logsize = 10 * 1024 * 1024;
+int logkeep = 5;
+unsigned logflags = 0;
+
+int nlowerdir = 0;
+char **lowerdirs = NULL;
 char upperdir[4096] = { 0 };
 
 char **pargv = NULL;
@@ -108,6 +205,20 @@ int dircnt(const char *name)
     return ret;
 }
 
+/**
+ * Put dir on top of the lower directories. The lower directories are kept from
+ * the bottom to the top, which is the reverse of the order of lowerdir=.
+ */
+void addlowerdir(const char *dir)
+{
+    lowerdirs = realloc(lowerdirs, sizeof(char *) * ++nlowerdir);
+    if (!lowerdirs)
+        die("realloc");
+    lowerdirs[nlowerdir - 1] = strdup(dir);
+    if (!lowerdirs[nlowerdir - 1])
+        die("strdup");
+}
+
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
 {
     switch (key) {
@@ -118,21 +229,12 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
         force = true;
         break;
     case 'o':
-        if (upperdir[0] && dircnt(upperdir) > 2) {
-            if (!lowerdir[0])
-                strcpy(lowerdir, upperdir);
-            else {
-                char buf[4096];
-                int ret = snprintf(buf, 4096, "%s:%s", upperdir, lowerdir);
-                if (ret > 4096)
-                    errx(EXIT_FAILURE, "Too many layers");
-                strcpy(lowerdir, buf);
-            }
-        }
+        if (upperdir[0] && dircnt(upperdir) > 2)
+            addlowerdir(upperdir);
         if (arg[0] != '/') {
             int ret = snprintf(upperdir, 4096, "%s/%s", layer_path, arg);
             if (ret > 4096)
-                errx(EXIT_FAILURE, "Too many layers");
+                errx(EXIT_FAILURE, "Path too long: %s", arg);
         } else {
             int ret = snprintf(upperdir, 4096, "%s", arg);
             if (ret > 4096)
@@ -203,6 +305,95 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
     case 1003:
         dnsserver = arg;
         break;
+    case 1010: // --trace
+        tracefile = arg;
+        break;
+    case 1011: // --zygote
+        usezygote = true;
+        break;
+    case 1013: // --passthrough
+        passthrough = true;
+        break;
+    case 1014: // --log
+        logfile = arg;
+        break;
+    case 1015: // --log-size
+        char *end;
+        logsize = strtoll(arg, &end, 10);
+        const char *units = "KMG";
+        const char *unit = *end ? strchr(units, toupper(*end)) : NULL;
+        if (end == arg || logsize < 0 || (*end && (!unit || end[1])))
+            errx(EXIT_FAILURE, "Invalid log size: %s", arg);
+        if (unit)
+            logsize <<= 10 * (unit - units + 1);
+        break;
+    case 1016: // --log-keep
+        logkeep = atoi(arg);
+        if (logkeep < 0)
+            errx(EXIT_FAILURE, "Invalid number of logs: %s", arg);
+        break;
+    case 1017: // --log-time
+        logflags |= LOG_TIME;
+        break;
+    case 1018: // --log-stream
+        logflags |= LOG_STREAM;
+        break;
+    case 1019: // --cpu-max
+        cgroupset("cpu.max", arg);
+        break;
+    case 1020: // --cpu-weight
+        cgroupset("cpu.weight", arg);
+        break;
+    case 1021: // --memory-max
+        cgroupset("memory.max", arg);
+        break;
+    case 1022: // --memory-high
+        cgroupset("memory.high", arg);
+        break;
+    case 1023: // --io-max
+        cgroupset("io.max", arg);
+        break;
+    case 1024: // --io-weight
+        cgroupset("io.weight", arg);
+        break;
+    case 1025: // --pids-max
+        cgroupset("pids.max", arg);
+        break;
+    case 1026: // --cpuset
+        cgroupset("cpuset.cpus", arg);
+        break;
+    case 1012: // --count
+        nzygote = atoi(arg);
+        if (nzygote < 1)
+            errx(EXIT_FAILURE, "Invalid number of zygotes: %s", arg);
+        break;
+    case 1005: // --dedup
+        dedup = true;
+        break;
+    case 1006: // --background
+        background = true;
+        break;
+    case 1007: // --sync
+        durable = true;
+        break;
+    case 1008: // --include
+        filter.include = realloc(filter.include, sizeof(char *) * ++filter.ninclude);
+        if (!filter.include)
+            die("realloc");
+        filter.include[filter.ninclude - 1] = arg;
+        break;
+    case 1009: // --exclude
+        filter.exclude = realloc(filter.exclude, sizeof(char *) * ++filter.nexclude);
+        if (!filter.exclude)
+            die("realloc");
+        filter.exclude[filter.nexclude - 1] = arg;
+        break;
+    case 'q':
+        verbosity = PULL_QUIET;
+        break;
+    case 'v':
+        verbosity = PULL_VERBOSE;
+        break;
     default:
         return ARGP_ERR_UNKNOWN;
     }
@@ -210,6 +401,122 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
     return 0;
 }
 
+/**
+ * Warn about lower layers in the layer path without an index, as their pull
+ * did not complete.
+ */
+static void checklayers()
+{
+    int index_fd = openat(layer_fd, ".index", O_DIRECTORY | O_CLOEXEC);
+    if (index_fd == -1)
+        return;
+
+    size_t len = strlen(layer_path);
+    for (int i = 0; i < nlowerdir; i++) {
+        const char *dir = lowerdirs[i];
+        if (strncmp(dir, layer_path, len) || dir[len] != '/' || strchr(dir + len + 1, '/'))
+            continue;
+        if (faccessat(index_fd, dir + len + 1, F_OK, 0) == -1)
+            warnx("Layer %s is incomplete, pull the image again", dir + len + 1);
+    }
+
+    close(index_fd);
+}
+
+// What a directory of a container holds at a path
+enum lookup {
+    ABSENT,
+    PROVIDED,
+    REMOVED,
+    SYMLINK
+};
+
+/**
+ * Look up path (without leading /) in the directory dir of a container. Pulled
+ * layers are searched in their index, other directories on disk. A whiteout,
+ * or a file or symbolic link in place of one of the parent directories, hides
+ * the path in the directories below; at is set to the path where this is.
+ */
+static enum lookup lookup(const char *dir, const char *path, int index_fd, char *at)
+{
+    size_t len = strlen(layer_path);
+    bool layer = !strncmp(dir, layer_path, len) && dir[len] == '/' && !strchr(dir + len + 1, '/');
+    struct index ix;
+    bool indexed = layer && index_fd != -1 && indexopen(&ix, index_fd, dir + len + 1) != -1;
+    int dir_fd = -1;
+    if (!indexed && (dir_fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC)) == -1)
+        return ABSENT;
+
+    // The path itself first, then its parents from the top down
+    enum lookup ret = ABSENT;
+    const char *p = NULL;
+    do {
+        snprintf(at, PATH_MAX, "%.*s", p ? (int) (p - path) : (int) strlen(path), path);
+
+        char type = 0;
+        if (indexed) {
+            const struct indexentry *e = indexfind(&ix, at);
+            if (e)
+                type = e->type == '1' ? '0' : e->type;
+        } else {
+            struct stat st;
+            if (!fstatat(dir_fd, at, &st, AT_SYMLINK_NOFOLLOW))
+                type = S_ISCHR(st.st_mode) && !st.st_rdev ? '3' : S_ISDIR(st.st_mode) ? '5' : S_ISLNK(st.st_mode) ? '2' : '0';
+        }
+
+        if (!p && type)
+            ret = type == '3' ? REMOVED : PROVIDED;
+        else if (p && type == '2')
+            ret = SYMLINK;
+        else if (p && type && type != '5')
+            ret = REMOVED;
+        p = strchr(p ? p + 1 : path, '/');
+    } while (ret == ABSENT && p);
+
+    if (indexed)
+        indexclose(&ix);
+    else
+        close(dir_fd);
+    return ret;
+}
+
+/**
+ * Print the directory of the container that provides path, searching from the
+ * top as overlayfs does. Returns false if none does.
+ */
+static bool which(const char *path, int index_fd)
+{
+    // Paths are in the form of the index, as in "usr/bin"
+    char rel[PATH_MAX];
+    while (path[0] == '/')
+        path++;
+    snprintf(rel, PATH_MAX, "%s", path);
+    for (size_t n = strlen(rel); n > 0 && rel[n - 1] == '/'; n--)
+        rel[n - 1] = 0;
+    if (!rel[0])
+        errx(EXIT_FAILURE, "Invalid path: /%s", path);
+
+    char at[PATH_MAX];
+    for (int i = upperdir[0] ? nlowerdir : nlowerdir - 1; i >= 0; i--) {
+        const char *dir = i == nlowerdir ? upperdir : lowerdirs[i];
+        switch (lookup(dir, rel, index_fd, at)) {
+        case PROVIDED:
+            printf("/%s: %s\n", rel, dir);
+            return true;
+        case REMOVED:
+            printf("/%s: hidden by /%s in %s\n", rel, at, dir);
+            return false;
+        case SYMLINK:
+            printf("/%s: /%s is a symbolic link in %s\n", rel, at, dir);
+            return false;
+        case ABSENT:
+            break;
+        }
+    }
+    printf("/%s: not found\n", rel);
+    return false;
+}
+
 int loadconfig(char ***argv, char *action, char *override)
 {
     int argc = 1;
@@ -266,12 +573,16 @@ int loadconfig(char ***argv, char *action, char *override)
     return argc;
 }
 
-int main(int argc, char **argv)
+/**
+ * Run poddos with the given arguments. Also used by the daemon, which sets
+ * supervised to start containers with lspawn().
+ */
+int poddos(int argc, char **argv)
 {
     struct argp argp = {
         .options = global_options,
         .parser = parse_opt,
-        .args_doc = "pull|start|exec|prune [OPTIONS...]"
+        .args_doc = "pull|start|exec|flatten|zygote|daemon|prune|which [OPTIONS...]"
     };
     int arg_index = 0;
     argp_parse(&argp, argc, argv, ARGP_NO_ARGS | ARGP_IN_ORDER, &arg_index, NULL);
@@ -301,15 +612,20 @@ int main(int argc, char **argv)
     if (mkdirat(layer_fd, "ephemeral", 0777) == -1 && errno != EEXIST)
         die("mkdir(ephemeral)");
 
+    // Flattening and zygotes work on the container as it is started
+    char *section = argv[arg_index];
+    if (!strcmp(section, "flatten") || !strcmp(section, "zygote") || !strcmp(section, "which"))
+        section = "start";
+
     int argc_from_config = 0;
     char **argv_from_config = NULL;
     if (name)
-        argc_from_config = loadconfig(&argv_from_config, argv[arg_index], "");
+        argc_from_config = loadconfig(&argv_from_config, section, "");
 
     int argc_from_override = 0;
     char **argv_from_override = NULL;
     if (name)
-        argc_from_override = loadconfig(&argv_from_override, argv[arg_index], ".2");
+        argc_from_override = loadconfig(&argv_from_override, section, ".2");
 
     if (!strcmp(argv[arg_index], "pull")) {
         argv[arg_index] = "poddos-pull";
@@ -323,7 +639,14 @@ int main(int argc, char **argv)
             argp_parse(&argp, argc_from_override, argv_from_override, ARGP_IN_ORDER, NULL, NULL);
         argp_parse(&argp, argc - arg_index, argv + arg_index, ARGP_IN_ORDER, NULL, NULL);
 
-        pull(url);
+        unsigned flags = verbosity;
+        if (dedup)
+            flags |= PULL_DEDUP;
+        if (background)
+            flags |= PULL_BACKGROUND;
+        if (durable)
+            flags |= PULL_SYNC;
+        pull(url, flags, &filter);
     } else if (!strcmp(argv[arg_index], "start")) {
         argv[arg_index] = "poddos-start";
         struct argp argp = {
@@ -369,8 +692,33 @@ int main(int argc, char **argv)
             flags |= LAYER_EPHEMERAL;
         if (ifname)
             flags |= LAYER_NET;
+        if (passthrough)
+            flags |= LAYER_PASSTHROUGH;
+        if (logfile && !supervised) {
+            if (passthrough || usezygote)
+                errx(EXIT_FAILURE, "--log cannot be combined with --passthrough or --zygote");
+            flags |= LAYER_LOG;
+            logopen(logfile, logsize, logkeep, logflags);
+        }
 
-        lstart(flags, pargv, penvp);
+        if (!tracefile)
+            tracefile = getenv("PODDOS_TRACE");
+        if (tracefile && tracefile[0])
+            traceopen(tracefile);
+
+        // The worker of the daemon would wait for the command to exit in
+        // zygotestart(), instead of handing pid 1 to the daemon
+        if (usezygote && supervised)
+            errx(EXIT_FAILURE, "--zygote is not supported for containers of the daemon");
+        if (usezygote && name)
+            zygotestart(pargv, penvp);
+
+        checklayers();
+        flatlower();
+        if (supervised)
+            spawned = lspawn(flags, pargv, penvp);
+        else
+            lstart(flags, pargv, penvp);
     } else if (!strcmp(argv[arg_index], "exec")) {
         argv[arg_index] = "poddos-exec";
         struct argp argp = {
@@ -402,6 +750,81 @@ int main(int argc, char **argv)
         pargv = argv + arg_index + cmd_index;
 
         lexec(0, pargv, penvp);
+    } else if (!strcmp(argv[arg_index], "flatten")) {
+        argv[arg_index] = "poddos-flatten";
+        struct argp argp = {
+            .options = flatten_options,
+            .parser = parse_opt,
+            .doc = "Merge the lower layers of a container into a single directory, which start then uses instead of the layers. "
+                "Files are hardlinked from the layers, and whiteouts are applied. "
+                "Only pulled layers can be flattened, as the snapshot is tied to their indexes. "
+                "This pays off for images with many layers, as every path lookup in the container probes all of them otherwise."
+        };
+        // The configuration is that of start, which has more options (and a command)
+        struct argp start = {.options = start_options,.parser = parse_opt };
+        int cmd_index = 0;
+        if (argc_from_config)
+            argp_parse(&start, argc_from_config, argv_from_config, ARGP_IN_ORDER, &cmd_index, NULL);
+        if (argc_from_override)
+            argp_parse(&start, argc_from_override, argv_from_override, ARGP_IN_ORDER, &cmd_index, NULL);
+        argp_parse(&argp, argc - arg_index, argv + arg_index, 0, NULL, NULL);
+
+        flatten(force);
+    } else if (!strcmp(argv[arg_index], "zygote")) {
+        argv[arg_index] = "poddos-zygote";
+        struct argp argp = {
+            .options = zygote_options,
+            .parser = parse_opt,
+            .doc = "Keep containers set up up to the execution of their command, such that start --zygote only needs to execute the command. "
+                "Every zygote that is used is replaced by a new one, right away with --ephemeral and otherwise once its container exited. "
+                "With more than one zygote, poddos exec enters the container that was started last, as long as it runs. "
+                "Zygotes listen on $XDG_RUNTIME_DIR/poddos/<NAME>.zygote, and are stopped with SIGTERM or SIGINT."
+        };
+        struct argp start = {.options = start_options,.parser = parse_opt };
+        int cmd_index = 0;
+        if (argc_from_config)
+            argp_parse(&start, argc_from_config, argv_from_config, ARGP_IN_ORDER, &cmd_index, NULL);
+        if (argc_from_override)
+            argp_parse(&start, argc_from_override, argv_from_override, ARGP_IN_ORDER, &cmd_index, NULL);
+        argp_parse(&argp, argc - arg_index, argv + arg_index, 0, NULL, NULL);
+
+        if (!name)
+            errx(EXIT_FAILURE, "Zygotes are only supported for named containers");
+        if (!upperdir[0])
+            errx(EXIT_FAILURE, "At least one overlay directory should be provided");
+
+        unsigned flags = 0;
+        if (ephemeral)
+            flags |= LAYER_EPHEMERAL;
+        if (ifname)
+            flags |= LAYER_NET;
+
+        checklayers();
+        flatlower();
+        zygote(flags, nzygote);
+    } else if (!strcmp(argv[arg_index], "daemon")) {
+        argv[arg_index] = "poddos-daemon";
+        struct argp argp = {
+            .options = daemon_options,
+            .parser = parse_opt,
+            .args_doc = "[start NAME [CMD...]|stop NAME|status]",
+            .doc = "Without arguments, run a daemon that starts and stops containers on request, and keeps them as its children. "
+                "The containers get no input, and their output is that of the daemon. "
+                "Networking (--net) is not supported for these containers. "
+                "With arguments, send the request to the daemon: start a container from its configuration (optionally with another command), stop it with SIGTERM, or show the status of all containers. "
+                "poddos exec works for containers started by the daemon. "
+                "The daemon listens on $XDG_RUNTIME_DIR/poddos/.daemon, and stops all its containers on SIGTERM or SIGINT."
+        };
+        int cmd_index = 0;
+        argp_parse(&argp, argc - arg_index, argv + arg_index, ARGP_IN_ORDER, &cmd_index, NULL);
+
+        char **request = argv + arg_index + cmd_index;
+        if (!request[0])
+            supervise();
+        else {
+            close(layer_fd);
+            return daemonrequest(request);
+        }
     } else if (!strcmp(argv[arg_index], "prune")) {
         argv[arg_index] = "poddos-prune";
         struct argp argp = {
@@ -422,9 +845,50 @@ int main(int argc, char **argv)
 
         if (prune_all)
             pruneall(force);
+    } else if (!strcmp(argv[arg_index], "which")) {
+        argv[arg_index] = "poddos-which";
+        struct argp argp = {
+            .options = which_options,
+            .parser = parse_opt,
+            .args_doc = "PATH...",
+            .doc = "Show which directory of a container provides each path, such as the layer with /usr/bin/python. "
+                "Pulled layers are looked up in their index, without reading the layer itself. "
+                "Symbolic links in the path are not followed. "
+                "Exits with status 1 if a path is not in the container."
+        };
+        struct argp start = {.options = start_options,.parser = parse_opt };
+        int cmd_index = 0;
+        if (argc_from_config)
+            argp_parse(&start, argc_from_config, argv_from_config, ARGP_IN_ORDER, &cmd_index, NULL);
+        if (argc_from_override)
+            argp_parse(&start, argc_from_override, argv_from_override, ARGP_IN_ORDER, &cmd_index, NULL);
+        cmd_index = 0;
+        argp_parse(&argp, argc - arg_index, argv + arg_index, ARGP_IN_ORDER, &cmd_index, NULL);
+
+        char **paths = argv + arg_index + cmd_index;
+        if (!paths[0])
+            errx(EXIT_FAILURE, "No path to look up");
+        if (!upperdir[0] && !nlowerdir)
+            errx(EXIT_FAILURE, "At least one overlay directory should be provided");
+
+        int index_fd = openat(layer_fd, ".index", O_DIRECTORY | O_CLOEXEC);
+        int ret = 0;
+        for (int i = 0; paths[i]; i++) {
+            if (!which(paths[i], index_fd))
+                ret = 1;
+        }
+        if (index_fd != -1)
+            close(index_fd);
+        close(layer_fd);
+        return ret;
     } else
         errx(EXIT_FAILURE, "Unrecognized action '%s'.", argv[arg_index]);
 
     close(layer_fd);
     return 0;
 }
+
+int main(int argc, char **argv)
+{
+    return poddos(argc, argv);
+}
@@ -2,6 +2,8 @@
 #define PODDOS_H
 
 #include <limits.h>
+#include <stdbool.h>
+#include <sys/types.h>
 #include <error.h>
 #include <errno.h>
 
@@ -10,14 +12,17 @@
 #define warn(...) error_at_line(0, errno, __FILE__, __LINE__, __VA_ARGS__)
 #define warnx(...) error_at_line(0, 0, __FILE__, __LINE__, __VA_ARGS__)
 
+int poddos(int argc, char **argv);
 int dircnt(const char *name);
+void addlowerdir(const char *dir);
 
 extern char *name;
 
 extern int layer_fd;
 extern char layer_path[PATH_MAX];
 
-extern char lowerdir[4096];
+extern int nlowerdir;
+extern char **lowerdirs;
 extern char upperdir[4096];
 
 extern char *ifname;
@@ -28,4 +33,7 @@ extern char **bind_from, **bind_to;
 
 extern char *directory;
 
+extern bool supervised;
+extern pid_t spawned;
+
 #endif
@@ -7,11 +7,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/sysmacros.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "flatten.h"
+#include "index.h"
 #include "layer.h"
 #include "poddos.h"
 
@@ -95,6 +98,15 @@ int prune(const char *layer)
             die("read(pipefd)");
         close(pipefd[0]);
 
+        // The index tells the size without walking the layer once more
+        struct index ix;
+        double mb = -1;
+        int index_fd = openat(layer_fd, ".index", O_DIRECTORY | O_CLOEXEC);
+        if (index_fd != -1 && indexopen(&ix, index_fd, layer) != -1) {
+            mb = ix.header->bytes / 1e6;
+            indexclose(&ix);
+        }
+
         int dirfd = openat(layer_fd, layer, O_DIRECTORY);
         if (dirfd == -1)
             die("could not open %s", layer);
@@ -105,7 +117,16 @@ int prune(const char *layer)
         if (unlinkat(layer_fd, layer, AT_REMOVEDIR) == -1)
             die("could not remove %s", layer);
 
-        printf("Removed %s (%d files).\n", layer, n);
+        if (index_fd != -1) {
+            if (unlinkat(index_fd, layer, 0) == -1 && errno != ENOENT)
+                die("could not remove index of %s", layer);
+            close(index_fd);
+        }
+
+        if (mb >= 0)
+            printf("Removed %s (%d files, %.1f MB).\n", layer, n, mb);
+        else
+            printf("Removed %s (%d files).\n", layer, n);
 
         exit(0);
     }
@@ -121,6 +142,174 @@ int prune(const char *layer)
     return 0;
 }
 
+// Remove the files from the content index that are no longer used by any layer
+static void prunecontent()
+{
+    int dirfd = openat(layer_fd, ".content", O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1) {
+        if (errno == ENOENT)
+            return;
+        die("open(.content)");
+    }
+    DIR *dir = fdopendir(dirfd);
+    if (!dir)
+        die("fdopendir(.content)");
+
+    int n = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        struct stat st;
+        if (fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            die("stat(.content/%s)", entry->d_name);
+        if (st.st_nlink > 1)
+            continue;
+        if (unlinkat(dirfd, entry->d_name, 0) == -1)
+            die("unlink(.content/%s)", entry->d_name);
+        n++;
+    }
+
+    closedir(dir);
+    if (n)
+        printf("Removed %d unused files from the content index.\n", n);
+}
+
+/**
+ * Whether a configuration in the layer path mentions layer, printing the
+ * configurations that do if verbose is set.
+ */
+static bool referenced(const char *layer, bool verbose)
+{
+    // Not a dup of layer_fd, which would share its position in the directory
+    // with the caller
+    int dirfd = openat(layer_fd, ".", O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+    if (dirfd == -1)
+        die("open(%s)", layer_path);
+    DIR *dir = fdopendir(dirfd);
+    if (!dir)
+        die("fdopendir(dirfd)");
+
+    bool somewhere = false;
+    struct dirent *file;
+    while ((file = readdir(dir))) {
+        if (file->d_name[0] == '.')
+            continue;
+
+        int fd = openat(layer_fd, file->d_name, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            die("could not open %s", file->d_name);
+
+        FILE *f = fdopen(fd, "r");
+        char buf[4097];
+        while (fscanf(f, " %4096s", buf) > 0) {
+            if (strstr(buf, layer)) {
+                if (verbose && somewhere)
+                    printf(", %s", file->d_name);
+                else if (verbose)
+                    printf("Found %s in %s", layer, file->d_name);
+                somewhere = true;
+                break;
+            }
+        }
+        fclose(f);
+    }
+
+    closedir(dir);
+    return somewhere;
+}
+
+/**
+ * Whether the snapshot name in .flat is no longer used: one of its layers
+ * changed, is gone or lost its index (so its name differs from the one flatten
+ * gives them now, if any), or is not used by any configuration anymore. Snapshots without a list
+ * of their layers are from an older version of poddos, and stale as well.
+ */
+static bool stale(int flat_fd, const char *name)
+{
+    char list[PATH_MAX];
+    snprintf(list, PATH_MAX, "%s.layers", name);
+    int fd = openat(flat_fd, list, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return true;
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        die("fstat(.flat/%s)", list);
+    char *buf = malloc(st.st_size + 1);
+    if (!buf)
+        die("malloc");
+    if (read(fd, buf, st.st_size) != st.st_size)
+        die("read(.flat/%s)", list);
+    close(fd);
+    buf[st.st_size] = 0;
+
+    int ndirs = 0;
+    char **dirs = NULL;
+    for (char *c = buf; c < buf + st.st_size; c += strlen(c) + 1) {
+        dirs = realloc(dirs, sizeof(char *) * ++ndirs);
+        if (!dirs)
+            die("realloc");
+        dirs[ndirs - 1] = c;
+    }
+
+    char flat[32];
+    bool unused = flatname(dirs, ndirs, flat, sizeof(flat)) != -1 || strcmp(flat, name);
+
+    size_t len = strlen(layer_path);
+    for (int i = 0; i < ndirs && !unused; i++) {
+        const char *dir = dirs[i];
+        if (!strncmp(dir, layer_path, len) && dir[len] == '/' && !strchr(dir + len + 1, '/'))
+            unused = !referenced(dir + len + 1, false);
+    }
+
+    free(dirs);
+    free(buf);
+    return unused;
+}
+
+// Remove the snapshots of flatten that are no longer used
+static void pruneflat()
+{
+    int flat_fd = openat(layer_fd, ".flat", O_DIRECTORY | O_CLOEXEC);
+    if (flat_fd == -1) {
+        if (errno == ENOENT)
+            return;
+        die("open(.flat)");
+    }
+    DIR *dir = fdopendir(flat_fd);
+    if (!dir)
+        die("fdopendir(.flat)");
+
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        // Skips snapshots that are being made as well
+        if (entry->d_name[0] == '.')
+            continue;
+
+        // Lists are removed with their snapshot, or if it is gone
+        char path[PATH_MAX];
+        size_t len = strlen(entry->d_name);
+        if (len > 7 && !strcmp(entry->d_name + len - 7, ".layers")) {
+            snprintf(path, PATH_MAX, "%.*s", (int) len - 7, entry->d_name);
+            if (faccessat(flat_fd, path, F_OK, AT_SYMLINK_NOFOLLOW) == -1 && errno == ENOENT
+                && unlinkat(flat_fd, entry->d_name, 0) == -1 && errno != ENOENT)
+                die("unlink(.flat/%s)", entry->d_name);
+            continue;
+        }
+
+        if (!stale(flat_fd, entry->d_name))
+            continue;
+        snprintf(path, PATH_MAX, ".flat/%s", entry->d_name);
+        prune(path);
+        snprintf(path, PATH_MAX, "%s.layers", entry->d_name);
+        if (unlinkat(flat_fd, path, 0) == -1 && errno != ENOENT)
+            die("unlink(.flat/%s)", path);
+    }
+
+    closedir(dir);
+}
+
 void pruneall(bool force)
 {
     int dirfd = dup(layer_fd);
@@ -133,7 +322,8 @@ void pruneall(bool force)
     struct dirent *entry;
     char layer[PATH_MAX] = { 0 };
     while ((entry = readdir(dir))) {
-        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+        // Skips the content index as well
+        if (entry->d_name[0] == '.')
             continue;
 
         strcpy(layer, entry->d_name);
@@ -142,35 +332,7 @@ void pruneall(bool force)
         int fd = openat(layer_fd, layer, O_DIRECTORY);
         if (fd > 0) {
             // Check whether there is a file with this hash there
-            bool somewhere = false;
-
-            long pos = telldir(dir);
-            rewinddir(dir);
-            struct dirent *file;
-            while ((file = readdir(dir))) {
-                if (!strcmp(file->d_name, ".") || !strcmp(file->d_name, ".."))
-                    continue;
-
-                int fd = openat(layer_fd, file->d_name, O_RDONLY);
-                if (fd == -1)
-                    die("could not open %s", file->d_name);
-
-                FILE *f = fdopen(fd, "r");
-                char buf[4097];
-                while (fscanf(f, " %4096s", buf) > 0) {
-                    if (strstr(buf, layer)) {
-                        if (somewhere)
-                            printf(", %s", file->d_name);
-                        else
-                            printf("Found %s in %s", layer, file->d_name);
-                        somewhere = true;
-                        break;
-                    }
-                }
-
-                close(fd);
-            }
-            seekdir(dir, pos);
+            bool somewhere = referenced(layer, true);
 
             if (!strstr(layer, ":merged") && !strstr(layer, ":work")) {
                 if (!somewhere) {
@@ -196,4 +358,9 @@ void pruneall(bool force)
     }
 
     closedir(dir);
+
+    // Snapshots hold on to the files of their layers, so they go before the
+    // content index is pruned
+    pruneflat();
+    prunecontent();
 }
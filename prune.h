@@ -1,6 +1,7 @@
 #ifndef PRUNE_H
 #define PRUNE_H
 
+int emptydir(int dirfd);
 int prune(const char *layer);
 void pruneall();
 
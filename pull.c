@@ -4,20 +4,29 @@
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/file.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/sysmacros.h>
 #include <sys/wait.h>
+#include <linux/ioprio.h>
 #include <linux/sched.h>
 #include <signal.h>
 #include <sched.h>
+#include <fnmatch.h>
+#include <stdbool.h>
+#include <time.h>
 
 #include "http.h"
 #include "json.h"
 #include "untar.h"
+#include "index.h"
 #include "inflate.h"
 #include "poddos.h"
 #include "layer.h"
+#include "prune.h"
+#include "pull.h"
 
 #if defined(__x86_64__)
 #define ARCH "amd64"
@@ -30,17 +39,267 @@
 #error "Unsupported architecture"
 #endif
 
-int pull(const char *full_url)
+// Maximum number of layers that are downloaded and extracted at the same time
+#define PULL_JOBS 4
+
+// Minimum time between two progress reports of a layer, in seconds
+#define PULL_PROGRESS 0.5
+
+struct progress {
+    const char *digest;
+    struct timespec start, last;
+    size_t entries;
+    unsigned long bytes;
+};
+
+static double elapsed(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/**
+ * Account for one more extracted entry of <size> bytes, and report how far
+ * the layer is if that was not done recently. Each report is a single line,
+ * such that layers that are pulled concurrently do not garble each other.
+ */
+static void progress(struct progress *p, unsigned long size, bool done)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (!p->entries && !done)
+        p->start = p->last = now;
+    p->entries += !done;
+    p->bytes += size;
+
+    if (!done && elapsed(&p->last, &now) < PULL_PROGRESS)
+        return;
+    p->last = now;
+
+    double t = elapsed(&p->start, &now);
+    fprintf(stderr, "%s %s: %zu entries, %.1f MB, %.1f MB/s\n", done ? "Pulled" : "Pulling", p->digest,
+            p->entries, p->bytes / 1e6, t > 0 ? p->bytes / 1e6 / t : 0);
+}
+
+/**
+ * Wait for one of the njobs layers being pulled by jobs to finish, and remove
+ * it from jobs. If it did not succeed, stop the other jobs and wait for them
+ * before bailing out, such that none of them keeps writing to its layer.
+ */
+static void waitjob(pid_t *jobs, int *njobs)
+{
+    int wstatus;
+    pid_t pid = wait(&wstatus);
+    if (pid == -1)
+        die("wait");
+    for (int i = 0; i < *njobs; i++) {
+        if (jobs[i] == pid) {
+            jobs[i] = jobs[--*njobs];
+            break;
+        }
+    }
+    if (WIFEXITED(wstatus) && !WEXITSTATUS(wstatus))
+        return;
+
+    for (int i = 0; i < *njobs; i++)
+        kill(jobs[i], SIGTERM);
+    while (*njobs) {
+        if (wait(NULL) == -1)
+            die("wait");
+        (*njobs)--;
+    }
+    if (WIFSIGNALED(wstatus))
+        diex("Pulling a layer failed (killed by signal %d, %s).", WTERMSIG(wstatus), strsignal(WTERMSIG(wstatus)));
+    diex("Pulling a layer failed (exit status %d).", WEXITSTATUS(wstatus));
+}
+
+static bool filtering(const struct pullfilter *filter)
+{
+    return filter->ninclude || filter->nexclude;
+}
+
+/**
+ * Name of the directory of the layer with the given digest. Layers that are
+ * extracted with a filter get a name based on the patterns, such that they
+ * are not mistaken for the full layer or a layer with other patterns.
+ */
+static void layername(char *buf, size_t n, const char *digest, const struct pullfilter *filter)
+{
+    const char *dir = strrchr(digest, ':');
+    if (!dir)
+        diex("Invalid digest: %s", digest);
+    if (!filtering(filter)) {
+        snprintf(buf, n, "%s", dir + 1);
+        return;
+    }
+
+    // FNV-1a hash of the patterns, including their kind and terminating NUL
+    unsigned hash = 2166136261u;
+    for (int i = 0; i < filter->ninclude + filter->nexclude; i++) {
+        const char *c = i < filter->ninclude ? filter->include[i] : filter->exclude[i - filter->ninclude];
+        hash = (hash ^ (i < filter->ninclude ? '+' : '-')) * 16777619u;
+        for (; *c; c++)
+            hash = (hash ^ (unsigned char) *c) * 16777619u;
+        hash *= 16777619u;
+    }
+    snprintf(buf, n, "%s-filtered-%08x", dir + 1, hash);
+}
+
+static bool matches(char **patterns, int n, const char *path)
+{
+    for (int i = 0; i < n; i++) {
+        // A pattern matching a directory also matches everything below it
+        if (!fnmatch(patterns[i], path, FNM_LEADING_DIR))
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Whether path should be left out. Paths are matched without a leading ./ or
+ * /. Directories are only left out if excluded, such that included files can
+ * always be created.
+ */
+static bool filtered(const struct pullfilter *filter, const char *path, bool dir)
+{
+    while (path[0] == '/' || (path[0] == '.' && path[1] == '/'))
+        path += path[0] == '/' ? 1 : 2;
+    if (matches(filter->exclude, filter->nexclude, path))
+        return true;
+    return !dir && filter->ninclude && !matches(filter->include, filter->ninclude, path);
+}
+
+// Download the layer described by the json object <layer> and extract it
+static void pulllayer(const char *url, const char *repository, const char *layer, const char *digest, unsigned flags,
+                      const struct pullfilter *filter)
+{
+    char url2[URL_MAX + 1];
+    char dir[100];
+    layername(dir, sizeof(dir), digest, filter);
+
+    char media_type[100];
+    if (jstr(jget(layer, "mediaType"), media_type, 100) == -1)
+        diex("Could not parse media type of %s", digest);
+
+    if (!(flags & PULL_QUIET))
+        fprintf(stderr, "Pulling %s...\n", digest);
+    int ret = snprintf(url2, URL_MAX, "https://%s/v2/%s/blobs/%s", url, repository, digest);
+    if (ret > URL_MAX)
+        diex("URL too long");
+
+    FILE *f = urlopen(url2, HTTP_ACCEPT, media_type);
+    if (!f)
+        diex("Could not open URL");
+
+    if (!strcmp(media_type, "application/vnd.docker.image.rootfs.diff.tar.gzip"))
+        f = finfl(f, INFL_AUTOCLOSE);
+    if (!strcmp(media_type, "application/vnd.oci.image.layer.v1.tar+gzip"))
+        f = finfl(f, INFL_AUTOCLOSE);
+
+    struct tarfile file = { 0 };
+    FILE *data;
+    int dir_fd = openat(layer_fd, dir, O_DIRECTORY);
+    struct tarpool *pool = tarpool(dir_fd);
+    int content_fd = -1;
+    if (flags & PULL_DEDUP) {
+        content_fd = openat(layer_fd, ".content", O_DIRECTORY | O_CLOEXEC);
+        if (content_fd == -1)
+            die("open(.content)");
+        tardedup(pool, content_fd);
+    }
+    if (flags & PULL_BACKGROUND)
+        tarwriteback(pool);
+    struct indexbuilder *index = indexnew();
+    tarindex(pool, index);
+    struct progress p = { digest };
+    while ((data = untar(f, &file))) {
+        if (flags & PULL_VERBOSE)
+            fprintf(stderr, "%s...\n", file.path);
+        else if (!(flags & PULL_QUIET))
+            progress(&p, file.size, false);
+        if (!strncmp(basename(file.path), ".wh.", 4)) {
+            if (!strcmp(basename(file.path), ".wh..wh..opq"))
+                die("Opaque whiteouts are not implemented");
+
+            // Make the path that should be removed
+            char path[PATH_MAX];
+            strcpy(path, file.path);
+            strcpy(strrchr(path, '/') + 1, strrchr(path, '/') + 5);
+
+            // overlayfs takes a character device 0:0 as a whiteout; without
+            // S_IFCHR, mknod makes a regular file, which hides nothing
+            if (mknodat(dir_fd, path, S_IFCHR, makedev(0, 0)) == -1)
+                die("mknod(%s, S_IFCHR, (0, 0))", path);
+
+            // Record what is on disk, rather than the entry in the archive
+            strcpy(file.path, path);
+            file.type = '3';
+            file.mode = 0;
+            indexadd(index, &file);
+        } else if (filtering(filter) && (filtered(filter, file.path, file.type == '5')
+                                         || (file.type == '1' && filtered(filter, file.linkpath, false)))) {
+            // Closing the stream skips the contents
+        } else
+            tarqueue(pool, &file, data);
+        fclose(data);
+    }
+    tarpoolclose(pool);
+    if (content_fd != -1)
+        close(content_fd);
+
+    // A single syncfs() makes the whole layer durable at once, and only
+    // then the index marks the layer as complete
+    if ((flags & PULL_SYNC) && syncfs(dir_fd) == -1)
+        die("syncfs(%s)", dir);
+
+    int index_fd = openat(layer_fd, ".index", O_DIRECTORY | O_CLOEXEC);
+    if (index_fd == -1)
+        die("open(.index)");
+    unsigned ixflags = 0;
+    if (content_fd != -1)
+        ixflags |= INDEX_HASH;
+    if (filtering(filter))
+        ixflags |= INDEX_FILTERED;
+    indexwrite(index, index_fd, dir, ixflags, flags & PULL_SYNC);
+    indexfree(index);
+    if ((flags & PULL_SYNC) && fsync(index_fd) == -1)
+        die("fsync(.index)");
+    close(index_fd);
+
+    if (!(flags & PULL_QUIET))
+        progress(&p, 0, true);
+    free(file.sparse);
+    fclose(f);
+    close(dir_fd);
+}
+
+/**
+ * Give the pull the lowest CPU and I/O priority, such that it does not slow
+ * down running containers. Both are inherited by the processes and threads
+ * that pull the layers.
+ */
+static void background()
+{
+    if (setpriority(PRIO_PROCESS, 0, 19) == -1)
+        die("setpriority");
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) == -1)
+        die("ioprio_set");
+}
+
+int pull(const char *full_url, unsigned flags, const struct pullfilter *filter)
 {
     char url[URL_MAX + 1], repository[URL_MAX + 1], ref[URL_MAX + 1], url2[URL_MAX + 1];
 
+    if (flags & PULL_BACKGROUND)
+        background();
+
     if (sscanf(full_url, "%1000[^/]/%1000[^:]:%1000s", url, repository, ref) != 3)
         return -1;
     int ret = snprintf(url2, URL_MAX, "https://%s/v2/%s/manifests/%s", url, repository, ref);
     if (ret > URL_MAX)
         diex("URL too long");
 
-    fprintf(stderr, "Retrieving available manifests...\n");
+    if (!(flags & PULL_QUIET))
+        fprintf(stderr, "Retrieving available manifests...\n");
 
     FILE *f =
         urlopen(url2, HTTP_ACCEPT,
@@ -89,7 +348,8 @@ int pull(const char *full_url)
     char digest2[100];
     if (jstr(digest, digest2, 100) == -1)
         return -1;
-    fprintf(stderr, "Retrieving manifest (%s)...\n", digest2);
+    if (!(flags & PULL_QUIET))
+        fprintf(stderr, "Retrieving manifest (%s)...\n", digest2);
 
     ret = snprintf(url2, URL_MAX, "https://%s/v2/%s/manifests/%s", url, repository, digest2);
     if (ret > URL_MAX)
@@ -124,64 +384,87 @@ int pull(const char *full_url)
             die("read(pipefd)");
         close(pipefd[0]);
 
+        if ((flags & PULL_DEDUP) && mkdirat(layer_fd, ".content", 0777) == -1 && errno != EEXIST)
+            die("mkdir(.content)");
+        if (mkdirat(layer_fd, ".index", 0777) == -1 && errno != EEXIST)
+            die("mkdir(.index)");
+        int index_fd = openat(layer_fd, ".index", O_DIRECTORY | O_CLOEXEC);
+        if (index_fd == -1)
+            die("open(.index)");
+
+        pid_t jobs[PULL_JOBS];
+        int njobs = 0;
+        char (*dirs)[100] = NULL;
+        int ndirs = 0;
         for (int i = 0; (layer = jindex(layers, i)); i++) {
             char digest[100];
             if (jstr(jget(layer, "digest"), digest, 100) == -1)
                 return -1;
 
-            char *dir = strrchr(digest, ':');
-            if (!dir)
-                diex("Invalid digest: %s", digest);
-
-            if (mkdirat(layer_fd, dir + 1, 0777) == -1) {
-                if (errno == EEXIST) {
-                    fprintf(stderr, "Skipping %s...\n", digest);
+            char dir[100];
+            layername(dir, sizeof(dir), digest, filter);
+
+            // A layer can occur more than once (as the empty layer does), but
+            // is only extracted by one job
+            bool seen = false;
+            for (int j = 0; j < ndirs && !seen; j++)
+                seen = !strcmp(dirs[j], dir);
+            if (seen)
+                continue;
+            dirs = realloc(dirs, sizeof(*dirs) * ++ndirs);
+            if (!dirs)
+                die("realloc");
+            strcpy(dirs[ndirs - 1], dir);
+
+            // Layers with an index are complete
+            if (mkdirat(layer_fd, dir, 0777) == -1) {
+                if (errno != EEXIST)
+                    die("mkdir(%s)", dir);
+                if (!faccessat(index_fd, dir, F_OK, 0)) {
+                    if (!(flags & PULL_QUIET))
+                        fprintf(stderr, "Skipping %s...\n", digest);
                     continue;
-                } else
-                    die("mkdir(%s)", dir + 1);
+                }
             }
 
-            char media_type[100];
-            if (jstr(jget(layer, "mediaType"), media_type, 100) == -1)
-                return -1;
-
-            fprintf(stderr, "Pulling %s...\n", digest);
-            int ret = snprintf(url2, URL_MAX, "https://%s/v2/%s/blobs/%s", url, repository, digest);
-            if (ret > URL_MAX)
-                diex("URL too long");
-
-            f = urlopen(url2, HTTP_ACCEPT, media_type);
-            if (!f)
-                diex("Could not open URL");
-
-            if (!strcmp(media_type, "application/vnd.docker.image.rootfs.diff.tar.gzip"))
-                f = finfl(f, INFL_AUTOCLOSE);
-            if (!strcmp(media_type, "application/vnd.oci.image.layer.v1.tar+gzip"))
-                f = finfl(f, INFL_AUTOCLOSE);
-
-            struct tarfile file;
-            FILE *data;
-            int dir_fd = openat(layer_fd, dir + 1, O_DIRECTORY);
-            while ((data = untar(f, &file))) {
-                fprintf(stderr, "%s...\n", file.path);
-                if (!strncmp(basename(file.path), ".wh.", 4)) {
-                    if (!strcmp(basename(file.path), ".wh..wh..opq"))
-                        die("Opaque whiteouts are not implemented");
-
-                    // Make the path that should be removed
-                    char path[PATH_MAX];
-                    strcpy(path, file.path);
-                    strcpy(strrchr(path, '/') + 1, strrchr(path, '/') + 5);
-
-                    if (mknodat(dir_fd, path, 0777, makedev(0, 0)) == -1)
-                        die("mknod(%s, 0777, (0, 0))", path);
-                } else
-                    tarwrite(file, data, dir_fd);
-                fclose(data);
+            // Layers are extracted in separate directories, so they can be
+            // pulled concurrently; the slowest layer determines the time to start.
+            if (njobs == PULL_JOBS)
+                waitjob(jobs, &njobs);
+
+            fflush(NULL);
+            pid_t job = fork();
+            if (job == -1)
+                die("fork");
+            if (job == 0) {
+                // The lock keeps other pulls of the layer from emptying it
+                // while it is extracted, and makes them wait for the index
+                int dirfd = openat(layer_fd, dir, O_DIRECTORY | O_CLOEXEC);
+                if (dirfd == -1)
+                    die("open(%s)", dir);
+                if (flock(dirfd, LOCK_EX) == -1)
+                    die("flock(%s)", dir);
+                if (!faccessat(index_fd, dir, F_OK, 0)) {
+                    if (!(flags & PULL_QUIET))
+                        fprintf(stderr, "Skipping %s...\n", digest);
+                    quick_exit(0);
+                }
+
+                // Layers without an index were not completely extracted
+                int n = emptydir(dirfd);
+                if (n == -1)
+                    die("could not empty %s", dir);
+                if (n && !(flags & PULL_QUIET))
+                    fprintf(stderr, "Removing incomplete %s...\n", digest);
+
+                pulllayer(url, repository, layer, digest, flags, filter);
+                quick_exit(0);
             }
-            fclose(f);
-            close(dir_fd);
+            jobs[njobs++] = job;
         }
+        free(dirs);
+        while (njobs)
+            waitjob(jobs, &njobs);
 
         quick_exit(0);
     }
@@ -192,7 +475,10 @@ int pull(const char *full_url)
     int wstatus;
     if (wait(&wstatus) == -1)
         die("wait");
-    if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus))
+    if (WIFSIGNALED(wstatus))
+        diex("Child crashed (killed by signal %d, %s). You may want to run 'poddos prune --all' to remove in-progress pulls now.",
+             WTERMSIG(wstatus), strsignal(WTERMSIG(wstatus)));
+    if (WEXITSTATUS(wstatus))
         diex("Child crashed (exit status %d). You may want to run 'poddos prune --all' to remove in-progress pulls now.", WEXITSTATUS(wstatus));
 
     // When done, write the configuration, but only if this is a named container
@@ -232,7 +518,12 @@ int pull(const char *full_url)
         if (fd == -1)
             die("open(%s)", config_name);
         FILE *f = fdopen(fd, "w");
-        fprintf(f, "[pull]\n--url=%s\n\n", full_url);
+        fprintf(f, "[pull]\n--url=%s\n", full_url);
+        for (int i = 0; i < filter->ninclude; i++)
+            fprintf(f, "--include=%s\n", filter->include[i]);
+        for (int i = 0; i < filter->nexclude; i++)
+            fprintf(f, "--exclude=%s\n", filter->exclude[i]);
+        fprintf(f, "\n");
 
         fprintf(f, "[start]\n");
 
@@ -241,7 +532,9 @@ int pull(const char *full_url)
             if (jstr(jget(layer, "digest"), digest, 1000) == -1)
                 diex("Could not parse layers %s", layer);
 
-            fprintf(f, "--overlay=%s\n", strrchr(digest, ':') + 1);
+            char dir[100];
+            layername(dir, sizeof(dir), digest, filter);
+            fprintf(f, "--overlay=%s\n", dir);
         }
 
         const char *envir;
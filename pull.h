@@ -1,6 +1,20 @@
 #ifndef PULL_H
 #define PULL_H
 
-int pull(const char *full_url);
+#define PULL_DEDUP 1
+#define PULL_QUIET 2
+#define PULL_VERBOSE 4
+#define PULL_BACKGROUND 8
+#define PULL_SYNC 16
+
+// Glob patterns selecting the paths that are extracted
+struct pullfilter {
+    int ninclude;
+    char **include;
+    int nexclude;
+    char **exclude;
+};
+
+int pull(const char *full_url, unsigned flags, const struct pullfilter *filter);
 
 #endif
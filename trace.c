@@ -0,0 +1,92 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+#include "poddos.h"
+
+// Maximum number of phases that are recorded
+#define TRACE_MAX 64
+
+/**
+ * Phases of starting a container, as offsets in microseconds on the
+ * CLOCK_MONOTONIC clock. Phases are consecutive: a phase ends when the next
+ * one begins.
+ */
+static struct {
+    const char *name;
+    long long start, end;
+} phases[TRACE_MAX];
+
+static int nphases = 0;
+static int tracefd = -1;
+static pid_t tracepid;
+
+static long long usecs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/**
+ * Start tracing to the file at path. The file is opened right away, as the
+ * path may not be reachable anymore when the trace is written (i.e., after
+ * pivot_root).
+ */
+void traceopen(const char *path)
+{
+    tracefd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (tracefd == -1)
+        die("open(%s)", path);
+    tracepid = getpid();
+}
+
+// End the current phase, if any, and begin the phase called name
+void tracephase(const char *name)
+{
+    if (tracefd == -1)
+        return;
+
+    long long now = usecs();
+    if (nphases > 0 && !phases[nphases - 1].end)
+        phases[nphases - 1].end = now;
+    if (nphases == TRACE_MAX)
+        return;
+    phases[nphases].name = name;
+    phases[nphases].start = now;
+    phases[nphases].end = 0;
+    nphases++;
+}
+
+/**
+ * End the current phase and write all phases in the Chrome trace event format,
+ * such that they can be loaded in chrome://tracing or Perfetto. Meant to be
+ * called right before the command of the container is executed.
+ */
+void traceflush()
+{
+    if (tracefd == -1)
+        return;
+
+    long long now = usecs();
+    if (nphases > 0 && !phases[nphases - 1].end)
+        phases[nphases - 1].end = now;
+
+    FILE *f = fdopen(tracefd, "w");
+    if (!f)
+        die("fdopen(trace)");
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (int i = 0; i < nphases; i++) {
+        fprintf(f, "{\"name\":\"%s\",\"cat\":\"start\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d},\n",
+                phases[i].name, phases[i].start, phases[i].end - phases[i].start, tracepid, tracepid);
+    }
+    fprintf(f, "{\"name\":\"execvp\",\"cat\":\"start\",\"ph\":\"i\",\"s\":\"p\",\"ts\":%lld,\"pid\":%d,\"tid\":%d}\n",
+            now, tracepid, tracepid);
+    fprintf(f, "],\"displayTimeUnit\":\"ms\"}\n");
+    if (fclose(f))
+        warn("Could not write trace");
+    tracefd = -1;
+}
@@ -0,0 +1,8 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+void traceopen(const char *path);
+void tracephase(const char *name);
+void traceflush();
+
+#endif
\ No newline at end of file
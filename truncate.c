@@ -35,9 +35,16 @@ static int truncclose(void *cookie)
 {
     int ret = 0;
     struct ftrunc *t = (struct ftrunc *) cookie;
-    if (t->flags & TRUNC_DRAIN)
-        while (t->n--)
-            (void) fgetc(t->f);
+    if (t->flags & TRUNC_DRAIN) {
+        // Skipped file contents can be large, so drain them in blocks
+        char buf[65536];
+        while (t->n > 0) {
+            size_t m = fread(buf, 1, t->n < sizeof(buf) ? t->n : sizeof(buf), t->f);
+            if (m == 0)
+                break;
+            t->n -= m;
+        }
+    }
     if (t->flags & TRUNC_AUTOCLOSE)
         ret = fclose(t->f) ? -1 : 0;
     free(t);
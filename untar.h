@@ -6,6 +6,16 @@
 #include <sys/types.h>
 #include <sys/time.h>
 
+struct tarsparse
+{
+    unsigned long offset;
+    unsigned long numbytes;
+};
+
+/**
+ * An entry of a tar archive. Must be zeroed before it is first passed to
+ * untar(), since the sparse map is reallocated between calls.
+ */
 struct tarfile
 {
     char path[PATH_MAX];
@@ -23,9 +33,25 @@ struct tarfile
     struct timeval atime;
 
     char type;
+
+    // For sparse files, the segments that are stored; size is the full size
+    int nsparse;
+    int capsparse;
+    struct tarsparse *sparse;
 };
 
+struct tarpool;
+struct indexbuilder;
+
 FILE *untar(FILE *f, struct tarfile *file);
-void tarwrite(struct tarfile file, FILE *f, int dir_fd);
+void tarwrite(const struct tarfile *file, FILE *f, int dir_fd);
+
+struct tarpool *tarpool(int dir_fd);
+void tardedup(struct tarpool *pool, int content_fd);
+void tarindex(struct tarpool *pool, struct indexbuilder *b);
+void tarwriteback(struct tarpool *pool);
+void tarqueue(struct tarpool *pool, const struct tarfile *file, FILE *f);
+void tarwait(struct tarpool *pool);
+void tarpoolclose(struct tarpool *pool);
 
 #endif
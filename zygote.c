@@ -0,0 +1,431 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "zygote.h"
+#include "cgroup.h"
+#include "layer.h"
+#include "poddos.h"
+
+// Maximum size of the command and environment handed to a zygote
+#define ZYGOTE_MSGMAX 65536
+
+/**
+ * The protocol over the (SOCK_SEQPACKET) socket is as follows. The client
+ * sends one message with the number of arguments, environment variables and
+ * bind mounts, followed by the NUL-terminated strings themselves (the working
+ * directory, empty for none, then the arguments, the environment and the
+ * source and target of every bind mount), and its standard input, output and
+ * error as SCM_RIGHTS. Then, it sends the number of every signal it receives
+ * as an int, until the zygote replies with the wait status of the command as
+ * an int.
+ */
+
+static struct sockaddr_un zygoteaddr()
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX };
+    char *tmpdir = getenv("XDG_RUNTIME_DIR") ? getenv("XDG_RUNTIME_DIR") : "/tmp";
+    int ret = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/poddos/%s.zygote", tmpdir, name);
+    if (ret >= (int) sizeof(addr.sun_path))
+        diex("Path of the socket of zygote %s too long", name);
+    return addr;
+}
+
+// The string at *c in a request that ends at end, moving *c past it
+static char *nextstr(char **c, const char *end)
+{
+    if (*c >= end)
+        diex("Invalid request");
+    char *s = *c;
+    *c += strlen(s) + 1;
+    return s;
+}
+
+static char **allocstrs(int n)
+{
+    char **strs = calloc(n + 1, sizeof(char *));
+    if (!strs)
+        die("calloc");
+    return strs;
+}
+
+/**
+ * Wait for a client as a fully prepared container, and run its command. The
+ * server is told via taken when this zygote got a client, so it can replace
+ * it.
+ */
+static void park(int sock, int taken, unsigned flags, const sigset_t *oldmask)
+{
+    // Parked zygotes are of no use without the server
+    if (prctl(PR_SET_PDEATHSIG, SIGKILL) == -1)
+        die("prctl(PR_SET_PDEATHSIG)");
+    if (sigprocmask(SIG_SETMASK, oldmask, NULL) == -1)
+        die("sigprocmask");
+
+    lprepare(flags);
+
+    // Only the owner of the zygote gets to run a command as it. Both the uid
+    // of the client and geteuid() are as seen in the user namespace of the
+    // container by now
+    int conn = -1;
+    while (conn == -1) {
+        conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1)
+            die("accept");
+        struct ucred cred;
+        socklen_t len = sizeof(cred);
+        if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+            die("getsockopt(SO_PEERCRED)");
+        if (cred.uid != geteuid()) {
+            warnx("Rejected a client with uid %d", cred.uid);
+            close(conn);
+            conn = -1;
+        }
+    }
+    close(sock);
+
+    // The container runs on, even if the server goes
+    if (prctl(PR_SET_PDEATHSIG, 0) == -1)
+        die("prctl(PR_SET_PDEATHSIG)");
+    pid_t self = getpid();
+    if (write(taken, &self, sizeof(self)) != sizeof(self))
+        die("write(taken)");
+    close(taken);
+
+    static char buf[ZYGOTE_MSGMAX];
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {.iov_base = buf,.iov_len = sizeof(buf) - 1 };
+    struct msghdr msg = {.msg_iov = &iov,.msg_iovlen = 1,.msg_control = control,.msg_controllen = sizeof(control) };
+    ssize_t n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+    if (n == -1)
+        die("recvmsg");
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (n < (ssize_t) (3 * sizeof(int)) || !cmsg || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int)))
+        diex("Invalid request");
+    int fds[3];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+    // Split the strings into the directory, the command, the environment and
+    // the bind mounts, which replace those of the configuration (as the client
+    // has read that as well)
+    int counts[3];
+    memcpy(counts, buf, sizeof(counts));
+    if (counts[0] < 1 || counts[0] > ZYGOTE_MSGMAX || counts[1] < 0 || counts[1] > ZYGOTE_MSGMAX
+        || counts[2] < 0 || counts[2] > ZYGOTE_MSGMAX)
+        diex("Invalid request");
+    buf[n] = 0;
+    char *c = buf + sizeof(counts), *end = buf + n;
+    directory = nextstr(&c, end);
+    if (!directory[0])
+        directory = NULL;
+    char **argv = allocstrs(counts[0]), **envp = allocstrs(counts[1]);
+    for (int i = 0; i < counts[0]; i++)
+        argv[i] = nextstr(&c, end);
+    for (int i = 0; i < counts[1]; i++)
+        envp[i] = nextstr(&c, end);
+    nbind = counts[2];
+    bind_from = allocstrs(nbind);
+    bind_to = allocstrs(nbind);
+    for (int i = 0; i < nbind; i++) {
+        bind_from[i] = nextstr(&c, end);
+        bind_to[i] = nextstr(&c, end);
+    }
+
+    // Block all signals, such that they are only seen via the file descriptor
+    sigset_t mask;
+    sigfillset(&mask);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+        die("sigprocmask");
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sfd == -1)
+        die("signalfd");
+
+    pid_t pid = fork();
+    if (pid == -1)
+        die("fork");
+    if (pid == 0) {
+        if (sigprocmask(SIG_SETMASK, oldmask, NULL) == -1)
+            die("sigprocmask");
+        for (int i = 0; i < 3; i++) {
+            if (dup2(fds[i], i) == -1)
+                die("dup2");
+        }
+        lfinish(argv, envp);
+    }
+    for (int i = 0; i < 3; i++)
+        close(fds[i]);
+    writepid(pid);
+
+    struct pollfd pfds[] = {
+        {.fd = conn,.events = POLLIN },
+        {.fd = sfd,.events = POLLIN },
+    };
+    for (;;) {
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            die("poll");
+        }
+        if (pfds[0].revents) {
+            // A signal to forward, or the client is gone
+            int signo;
+            n = recv(conn, &signo, sizeof(signo), 0);
+            if (n == sizeof(signo))
+                kill(pid, signo);
+            else {
+                kill(pid, SIGKILL);
+                pfds[0].fd = -1;
+            }
+        }
+        if (pfds[1].revents & POLLIN) {
+            struct signalfd_siginfo fdsi;
+            if (read(sfd, &fdsi, sizeof(fdsi)) != sizeof(fdsi))
+                die("read(sfd)");
+            if (fdsi.ssi_signo == SIGCHLD)
+                break;
+            kill(pid, fdsi.ssi_signo);
+        }
+    }
+
+    int wstatus;
+    if (waitpid(pid, &wstatus, 0) == -1)
+        die("waitpid");
+    removepid(pid);
+    send(conn, &wstatus, sizeof(wstatus), MSG_NOSIGNAL);
+    exit(0);
+}
+
+static pid_t spawnzygote(int sock, int taken, unsigned flags, const sigset_t *oldmask)
+{
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid == -1)
+        die("fork");
+    if (pid == 0)
+        park(sock, taken, flags, oldmask);
+    return pid;
+}
+
+/**
+ * Keep count containers prepared up to the execution of their command, which
+ * a client (start --zygote) then provides, until SIGTERM or SIGINT. Each
+ * zygote that gets a client is replaced right away if the containers are
+ * ephemeral, and otherwise once its container exited, as the new one would
+ * mount the same upper directory.
+ */
+void zygote(unsigned flags, int count)
+{
+    if (flags & LAYER_NET)
+        diex("Zygotes do not support --net");
+    if (count > 1 && !(flags & LAYER_EPHEMERAL))
+        diex("More than one zygote requires --ephemeral, as containers cannot share their upper directory");
+
+    // The zygotes create the cgroup of the container as a child of the
+    // cgroup of this process
+    cgroupsupervise();
+
+    struct sockaddr_un addr = zygoteaddr();
+    char *dir = strdup(addr.sun_path);
+    if (!dir)
+        die("strdup");
+    *strrchr(dir, '/') = 0;
+    if (mkdir(dir, 0777) == -1 && errno != EEXIST)
+        die("mkdir(%s)", dir);
+    free(dir);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        die("socket");
+    if (unlink(addr.sun_path) == -1 && errno != ENOENT)
+        die("unlink(%s)", addr.sun_path);
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        die("bind(%s)", addr.sun_path);
+    if (listen(sock, count) == -1)
+        die("listen");
+
+    int taken[2];
+    if (pipe2(taken, O_CLOEXEC) == -1)
+        die("pipe");
+
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGINT);
+    if (sigprocmask(SIG_BLOCK, &mask, &oldmask) == -1)
+        die("sigprocmask");
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sfd == -1)
+        die("signalfd");
+
+    // A zygote stays in parked while its container runs if it is not replaced
+    // right away, which used tells
+    pid_t *parked = calloc(count, sizeof(pid_t));
+    bool *used = calloc(count, sizeof(bool));
+    if (!parked || !used)
+        die("calloc");
+    for (int i = 0; i < count; i++)
+        parked[i] = spawnzygote(sock, taken[1], flags, &oldmask);
+
+    struct pollfd pfds[] = {
+        {.fd = taken[0],.events = POLLIN },
+        {.fd = sfd,.events = POLLIN },
+    };
+    for (;;) {
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            die("poll");
+        }
+        if (pfds[0].revents & POLLIN) {
+            pid_t pid;
+            if (read(taken[0], &pid, sizeof(pid)) != sizeof(pid))
+                die("read(taken)");
+            for (int i = 0; i < count; i++) {
+                if (parked[i] == pid && (flags & LAYER_EPHEMERAL))
+                    parked[i] = spawnzygote(sock, taken[1], flags, &oldmask);
+                else if (parked[i] == pid)
+                    used[i] = true;
+            }
+        }
+        if (pfds[1].revents & POLLIN) {
+            struct signalfd_siginfo fdsi;
+            if (read(sfd, &fdsi, sizeof(fdsi)) != sizeof(fdsi))
+                die("read(sfd)");
+            if (fdsi.ssi_signo != SIGCHLD)
+                break;
+
+            // Zygotes that exit while parked failed to set up their container
+            pid_t pid;
+            int wstatus;
+            while ((pid = waitpid(-1, &wstatus, WNOHANG)) > 0) {
+                for (int i = 0; i < count; i++) {
+                    if (parked[i] == pid && used[i]) {
+                        used[i] = false;
+                        parked[i] = spawnzygote(sock, taken[1], flags, &oldmask);
+                    } else if (parked[i] == pid) {
+                        parked[i] = 0;
+                        warnx("Zygote %d exited before use (exit status %d)", pid, WEXITSTATUS(wstatus));
+                        goto out;
+                    }
+                }
+            }
+        }
+    }
+
+  out:
+    for (int i = 0; i < count; i++) {
+        if (parked[i] > 0 && !used[i])
+            kill(parked[i], SIGKILL);
+    }
+    unlink(addr.sun_path);
+    free(parked);
+    free(used);
+}
+
+// Append the string s to the request in buf, which is len bytes long
+static void addstr(char *buf, size_t *len, const char *s)
+{
+    size_t n = strlen(s) + 1;
+    if (*len + n > ZYGOTE_MSGMAX)
+        diex("Command and environment too long for a zygote");
+    memcpy(buf + *len, s, n);
+    *len += n;
+}
+
+/**
+ * Run the command in a zygote of the current container, with the standard
+ * input, output and error of this process. Returns -1 if there is no zygote,
+ * and otherwise exits as the command did.
+ */
+int zygotestart(char **argv, char **envp)
+{
+    struct sockaddr_un addr = zygoteaddr();
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        die("socket");
+    if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        if (errno == ENOENT || errno == ECONNREFUSED) {
+            close(sock);
+            return -1;
+        }
+        die("connect(%s)", addr.sun_path);
+    }
+
+    static char buf[ZYGOTE_MSGMAX];
+    int counts[3] = { 0, 0, nbind };
+    size_t len = sizeof(counts);
+    addstr(buf, &len, directory ? directory : "");
+    for (int i = 0; i < 2; i++) {
+        for (char **s = i ? envp : argv; *s; s++) {
+            addstr(buf, &len, *s);
+            counts[i]++;
+        }
+    }
+    for (int i = 0; i < nbind; i++) {
+        addstr(buf, &len, bind_from[i]);
+        addstr(buf, &len, bind_to[i]);
+    }
+    memcpy(buf, counts, sizeof(counts));
+
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    char control[CMSG_SPACE(sizeof(fds))] = { 0 };
+    struct iovec iov = {.iov_base = buf,.iov_len = len };
+    struct msghdr msg = {.msg_iov = &iov,.msg_iovlen = 1,.msg_control = control,.msg_controllen = sizeof(control) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    if (sendmsg(sock, &msg, 0) == -1)
+        die("sendmsg");
+
+    // Forward all signals to the zygote, until the command exits
+    sigset_t mask;
+    sigfillset(&mask);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+        die("sigprocmask");
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sfd == -1)
+        die("signalfd");
+
+    struct pollfd pfds[] = {
+        {.fd = sock,.events = POLLIN },
+        {.fd = sfd,.events = POLLIN },
+    };
+    for (;;) {
+        if (poll(pfds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            die("poll");
+        }
+        if (pfds[0].revents) {
+            int wstatus;
+            if (recv(sock, &wstatus, sizeof(wstatus), 0) != sizeof(wstatus))
+                diex("Zygote exited unexpectedly");
+            exitas(wstatus);
+        }
+        if (pfds[1].revents & POLLIN) {
+            struct signalfd_siginfo fdsi;
+            if (read(sfd, &fdsi, sizeof(fdsi)) != sizeof(fdsi))
+                die("read(sfd)");
+            int signo = fdsi.ssi_signo;
+            if (signo != SIGCHLD && send(sock, &signo, sizeof(signo), MSG_NOSIGNAL) == -1)
+                die("send");
+        }
+    }
+}
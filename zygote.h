@@ -0,0 +1,7 @@
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+void zygote(unsigned flags, int count);
+int zygotestart(char **argv, char **envp);
+
+#endif
\ No newline at end of file